@@ -0,0 +1,147 @@
+/*
+ * Cost of calc_envelope per slot and sample, with the switches on eg_rate_h, against the steps looked up from
+ * eg_step_pattern, which measured slower and is only used to schedule sleeping envelopes. Both are run over the same
+ * random slots, which also checks that they agree.
+ * It includes emu2413.c to reach the static envelope generator.
+ */
+#include "emu2413.c"
+#include <time.h>
+
+#define TICKS 4000000
+#define RUNS 7
+
+/* calc_envelope with the steps looked up from eg_step_pattern, the transitions are the same */
+static INLINE uint32_t table_calc_envelope(OPLL *opll, int i, uint16_t eg_counter, uint8_t test) {
+  OPLL_SLOT *slot = &opll->slot[i];
+  const uint32_t attack = slot->eg_state == ATTACK;
+  const uint32_t mask = (1 << slot->eg_shift) - 1;
+  /* the attack steps on 4 consecutive counts */
+  const uint32_t wait = eg_counter & mask & (attack ? ~3 : ~0);
+  uint32_t eg_out = opll->eg_out[i];
+  uint32_t reset = 0;
+
+  if (!wait) {
+    const uint64_t pattern = eg_step_pattern[attack][slot->eg_rate_h][slot->eg_rate_l];
+    const uint32_t step = (uint32_t)(pattern >> (((eg_counter >> slot->eg_shift) & 15) * 4)) & 15;
+    if (step) {
+      eg_out = attack ? max(0, (int)eg_out - (eg_out >> step) - 1) : min(EG_MUTE, eg_out + step);
+    }
+  }
+
+  switch (slot->eg_state) {
+  case DAMP:
+    if (eg_out >= EG_MAX && (eg_counter & mask) == 0) {
+      start_envelope(slot, &eg_out);
+      if (slot->type & 1) {
+        if (!slot->pg_keep) {
+          opll->pg_phase[i] = 0;
+        }
+        if (slot->type == 1 && !opll->slot[i - 1].pg_keep) {
+          reset = 1 << (i - 1);
+        }
+      }
+    }
+    break;
+  case ATTACK:
+    if (eg_out == 0) {
+      slot->eg_state = DECAY;
+      request_update(slot, UPDATE_EG);
+    }
+    break;
+  case DECAY:
+    if ((eg_out >> 3) == slot->patch->SL) {
+      slot->eg_state = SUSTAIN;
+      request_update(slot, UPDATE_EG);
+    }
+    break;
+  default:
+    break;
+  }
+
+  if (test) {
+    eg_out = 0;
+  }
+
+  opll->eg_out[i] = eg_out;
+  return reset;
+}
+
+static uint32_t seed;
+
+static uint32_t next_rand(void) {
+  seed = seed * 1103515245u + 12345u;
+  return seed >> 8;
+}
+
+/* the eg_shift that update_eg sets for a rate */
+static uint8_t get_shift(int eg_state, int rate_h) {
+  if (rate_h == 0)
+    return 0;
+  if (eg_state == ATTACK)
+    return rate_h < 12 ? 13 - rate_h : 0;
+  return rate_h < 13 ? 13 - rate_h : 0;
+}
+
+static void set_rate(OPLL_SLOT *slot, int eg_state, int fast) {
+  slot->eg_state = eg_state;
+  slot->eg_rate_h = fast ? 12 + next_rand() % 4 : next_rand() % 16;
+  slot->eg_rate_l = next_rand() & 3;
+  slot->eg_shift = get_shift(eg_state, slot->eg_rate_h);
+}
+
+/* run 18 random slots for TICKS samples, returns the seconds taken and the sum of the envelopes */
+static double run(OPLL *opll, OPLL_PATCH *patch, int table, int fast, uint32_t *sum) {
+  clock_t t;
+  uint32_t c;
+  int i;
+
+  seed = 1;
+  for (i = 0; i < 18; i++) {
+    OPLL_SLOT *slot = &opll->slot[i];
+    memset(slot, 0, sizeof(*slot));
+    patch[i].SL = next_rand() & 15;
+    slot->patch = &patch[i];
+    slot->type = i & 1;
+    set_rate(slot, next_rand() % 4, fast);
+    opll->eg_out[i] = next_rand() & 127;
+  }
+
+  t = clock();
+  for (c = 0; c < TICKS; c++) {
+    for (i = 0; i < 18; i++) {
+      OPLL_SLOT *slot = &opll->slot[i];
+      if (table) {
+        table_calc_envelope(opll, i, (uint16_t)c, 0);
+      } else {
+        calc_envelope(opll, i, (uint16_t)c, 0);
+      }
+      *sum += opll->eg_out[i];
+      /* restart the attack of a finished envelope, so that every state keeps being exercised */
+      if (slot->eg_state == SUSTAIN && opll->eg_out[i] >= EG_MUTE - 1) {
+        opll->eg_out[i] = 0;
+        set_rate(slot, ATTACK, fast);
+      }
+    }
+  }
+  return (double)(clock() - t) / CLOCKS_PER_SEC;
+}
+
+int main(void) {
+  static OPLL opll;
+  static OPLL_PATCH patch[18];
+  int fast, table, r;
+
+  for (fast = 0; fast < 2; fast++) {
+    double best[2] = {1e9, 1e9};
+    uint32_t sum[2] = {0, 0};
+    for (r = 0; r < RUNS; r++) {
+      for (table = 0; table < 2; table++) {
+        const double s = run(&opll, patch, table, fast, &sum[table]);
+        best[table] = s < best[table] ? s : best[table];
+      }
+    }
+    printf("%s: switch %.2f ns, table %.2f ns per call%s\n", fast ? "rates 12-15" : "random rates",
+           best[0] / TICKS / 18 * 1e9, best[1] / TICKS / 18 * 1e9, sum[0] == sum[1] ? "" : " (envelopes differ!)");
+  }
+  return 0;
+}
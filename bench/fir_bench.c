@@ -0,0 +1,62 @@
+/*
+ * Cost of the rate converter per output frame, excluding the input pushes. Each case is run five times and the
+ * fastest run is reported. Build the fir_bench and fir_bench_scalar targets to compare the SIMD kernel of converters
+ * with more than 2 channels with the portable one. Converters of 1 or 2 channels run the same code in both.
+ */
+#include "emu2413.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double bench(int ch, int taps, long frames) {
+  OPLL_RateConvConfig config;
+  OPLL_RateConv *conv;
+  int16_t in[16], out[16];
+  int32_t acc = 0;
+  clock_t t;
+  long i;
+  int c;
+
+  OPLL_RateConv_getDefaultConfig(&config);
+  config.taps = taps;
+  /* an output rate far above the input rate, so that the pushes are rare */
+  conv = OPLL_RateConv_newWithConfig(3579545 / 72.0, 3579545 / 72.0 * 64, ch, &config);
+  OPLL_RateConv_reset(conv);
+
+  t = clock();
+  for (i = 0; i < frames; i++) {
+    if ((i & 63) == 0) {
+      for (c = 0; c < ch; c++) {
+        in[c] = (int16_t)(i * (7 + c * 6));
+      }
+      OPLL_RateConv_putFrame(conv, in);
+    }
+    OPLL_RateConv_getFrame(conv, out);
+    acc += out[0];
+  }
+  t = clock() - t;
+
+  OPLL_RateConv_delete(conv);
+  if (acc == 0x7fffffff)
+    printf("\n"); /* keep the results alive */
+  return (double)t / CLOCKS_PER_SEC / frames * 1e9;
+}
+
+int main(int argc, char **argv) {
+  static const int channels[] = {1, 2, 3, 4, 8, 14};
+  static const int taps[] = {16, 32, 64};
+  const long frames = argc > 1 ? atol(argv[1]) : 4000000;
+  int c, t, r;
+
+  for (c = 0; c < 6; c++) {
+    for (t = 0; t < 3; t++) {
+      double best = bench(channels[c], taps[t], frames);
+      for (r = 1; r < 5; r++) {
+        const double ns = bench(channels[c], taps[t], frames);
+        best = ns < best ? ns : best;
+      }
+      printf("%2d ch, %2d taps: %6.2f ns per frame\n", channels[c], taps[t], best);
+    }
+  }
+  return 0;
+}
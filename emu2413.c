@@ -16,6 +16,18 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* define EMU2413_NO_SIMD to use the portable C code only. */
+#if !defined(EMU2413_NO_SIMD)
+#if defined(__AVX2__)
+#define EMU2413_AVX2 1
+#define EMU2413_SSE2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define EMU2413_SSE2 1
+#include <emmintrin.h>
+#endif
+#endif
+
 #ifndef INLINE
 #if defined(_MSC_VER)
 #define INLINE __inline
@@ -29,69 +41,78 @@
 #define _PI_ 3.14159265358979323846264338327950288
 
 #define OPLL_TONE_NUM 3
+
+/* modulator and carrier patches from the 8-byte register dump of a voice, as OPLL_dumpToPatch. */
+#define DUMP_TO_PATCH(d0, d1, d2, d3, d4, d5, d6, d7)                                                                \
+  {(d2) & 63, (d3) & 7, ((d0) >> 5) & 1, (d0) & 15, (d4) >> 4, (d4) & 15, (d6) >> 4, (d6) & 15, ((d0) >> 4) & 1,     \
+   (d2) >> 6, (d0) >> 7, ((d0) >> 6) & 1, ((d3) >> 3) & 1},                                                          \
+  {0, 0, ((d1) >> 5) & 1, (d1) & 15, (d5) >> 4, (d5) & 15, (d7) >> 4, (d7) & 15, ((d1) >> 4) & 1, (d3) >> 6,         \
+   (d1) >> 7, ((d1) >> 6) & 1, ((d3) >> 4) & 1}
+
+/* ROM patch sets, shared by all chips. patches 0 and 1 are placeholders of the user patch. */
 /* clang-format off */
-static uint8_t default_inst[OPLL_TONE_NUM][(16 + 3) * 8] = {{
-0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00, // 0: User
-0x71,0x61,0x1e,0x17,0xd0,0x78,0x00,0x17, // 1: Violin
-0x13,0x41,0x1a,0x0d,0xd8,0xf7,0x23,0x13, // 2: Guitar
-0x13,0x01,0x99,0x00,0xf2,0xc4,0x21,0x23, // 3: Piano
-0x11,0x61,0x0e,0x07,0x8d,0x64,0x70,0x27, // 4: Flute
-0x32,0x21,0x1e,0x06,0xe1,0x76,0x01,0x28, // 5: Clarinet
-0x31,0x22,0x16,0x05,0xe0,0x71,0x00,0x18, // 6: Oboe
-0x21,0x61,0x1d,0x07,0x82,0x81,0x11,0x07, // 7: Trumpet
-0x33,0x21,0x2d,0x13,0xb0,0x70,0x00,0x07, // 8: Organ
-0x61,0x61,0x1b,0x06,0x64,0x65,0x10,0x17, // 9: Horn
-0x41,0x61,0x0b,0x18,0x85,0xf0,0x81,0x07, // A: Synthesizer
-0x33,0x01,0x83,0x11,0xea,0xef,0x10,0x04, // B: Harpsichord
-0x17,0xc1,0x24,0x07,0xf8,0xf8,0x22,0x12, // C: Vibraphone
-0x61,0x50,0x0c,0x05,0xd2,0xf5,0x40,0x42, // D: Synthsizer Bass
-0x01,0x01,0x55,0x03,0xe9,0x90,0x03,0x02, // E: Acoustic Bass
-0x41,0x41,0x89,0x03,0xf1,0xe4,0xc0,0x13, // F: Electric Guitar
-0x01,0x01,0x18,0x0f,0xdf,0xf8,0x6a,0x6d, // R: Bass Drum (from VRC7)
-0x01,0x01,0x00,0x00,0xc8,0xd8,0xa7,0x68, // R: High-Hat(M) / Snare Drum(C) (from VRC7)
-0x05,0x01,0x00,0x00,0xf8,0xaa,0x59,0x55, // R: Tom-tom(M) / Top Cymbal(C) (from VRC7)
+static const OPLL_PATCH default_patch[OPLL_TONE_NUM][(16 + 3) * 2] = {{
+DUMP_TO_PATCH(0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00), // 0: User
+DUMP_TO_PATCH(0x71,0x61,0x1e,0x17,0xd0,0x78,0x00,0x17), // 1: Violin
+DUMP_TO_PATCH(0x13,0x41,0x1a,0x0d,0xd8,0xf7,0x23,0x13), // 2: Guitar
+DUMP_TO_PATCH(0x13,0x01,0x99,0x00,0xf2,0xc4,0x21,0x23), // 3: Piano
+DUMP_TO_PATCH(0x11,0x61,0x0e,0x07,0x8d,0x64,0x70,0x27), // 4: Flute
+DUMP_TO_PATCH(0x32,0x21,0x1e,0x06,0xe1,0x76,0x01,0x28), // 5: Clarinet
+DUMP_TO_PATCH(0x31,0x22,0x16,0x05,0xe0,0x71,0x00,0x18), // 6: Oboe
+DUMP_TO_PATCH(0x21,0x61,0x1d,0x07,0x82,0x81,0x11,0x07), // 7: Trumpet
+DUMP_TO_PATCH(0x33,0x21,0x2d,0x13,0xb0,0x70,0x00,0x07), // 8: Organ
+DUMP_TO_PATCH(0x61,0x61,0x1b,0x06,0x64,0x65,0x10,0x17), // 9: Horn
+DUMP_TO_PATCH(0x41,0x61,0x0b,0x18,0x85,0xf0,0x81,0x07), // A: Synthesizer
+DUMP_TO_PATCH(0x33,0x01,0x83,0x11,0xea,0xef,0x10,0x04), // B: Harpsichord
+DUMP_TO_PATCH(0x17,0xc1,0x24,0x07,0xf8,0xf8,0x22,0x12), // C: Vibraphone
+DUMP_TO_PATCH(0x61,0x50,0x0c,0x05,0xd2,0xf5,0x40,0x42), // D: Synthsizer Bass
+DUMP_TO_PATCH(0x01,0x01,0x55,0x03,0xe9,0x90,0x03,0x02), // E: Acoustic Bass
+DUMP_TO_PATCH(0x41,0x41,0x89,0x03,0xf1,0xe4,0xc0,0x13), // F: Electric Guitar
+DUMP_TO_PATCH(0x01,0x01,0x18,0x0f,0xdf,0xf8,0x6a,0x6d), // R: Bass Drum (from VRC7)
+DUMP_TO_PATCH(0x01,0x01,0x00,0x00,0xc8,0xd8,0xa7,0x68), // R: High-Hat(M) / Snare Drum(C) (from VRC7)
+DUMP_TO_PATCH(0x05,0x01,0x00,0x00,0xf8,0xaa,0x59,0x55), // R: Tom-tom(M) / Top Cymbal(C) (from VRC7)
 },{
 /* VRC7 presets from Nuke.YKT */
-0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-0x03,0x21,0x05,0x06,0xe8,0x81,0x42,0x27,
-0x13,0x41,0x14,0x0d,0xd8,0xf6,0x23,0x12,
-0x11,0x11,0x08,0x08,0xfa,0xb2,0x20,0x12,
-0x31,0x61,0x0c,0x07,0xa8,0x64,0x61,0x27,
-0x32,0x21,0x1e,0x06,0xe1,0x76,0x01,0x28,
-0x02,0x01,0x06,0x00,0xa3,0xe2,0xf4,0xf4,
-0x21,0x61,0x1d,0x07,0x82,0x81,0x11,0x07,
-0x23,0x21,0x22,0x17,0xa2,0x72,0x01,0x17,
-0x35,0x11,0x25,0x00,0x40,0x73,0x72,0x01,
-0xb5,0x01,0x0f,0x0F,0xa8,0xa5,0x51,0x02,
-0x17,0xc1,0x24,0x07,0xf8,0xf8,0x22,0x12,
-0x71,0x23,0x11,0x06,0x65,0x74,0x18,0x16,
-0x01,0x02,0xd3,0x05,0xc9,0x95,0x03,0x02,
-0x61,0x63,0x0c,0x00,0x94,0xC0,0x33,0xf6,
-0x21,0x72,0x0d,0x00,0xc1,0xd5,0x56,0x06,
-0x01,0x01,0x18,0x0f,0xdf,0xf8,0x6a,0x6d,
-0x01,0x01,0x00,0x00,0xc8,0xd8,0xa7,0x68,
-0x05,0x01,0x00,0x00,0xf8,0xaa,0x59,0x55,
+DUMP_TO_PATCH(0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00),
+DUMP_TO_PATCH(0x03,0x21,0x05,0x06,0xe8,0x81,0x42,0x27),
+DUMP_TO_PATCH(0x13,0x41,0x14,0x0d,0xd8,0xf6,0x23,0x12),
+DUMP_TO_PATCH(0x11,0x11,0x08,0x08,0xfa,0xb2,0x20,0x12),
+DUMP_TO_PATCH(0x31,0x61,0x0c,0x07,0xa8,0x64,0x61,0x27),
+DUMP_TO_PATCH(0x32,0x21,0x1e,0x06,0xe1,0x76,0x01,0x28),
+DUMP_TO_PATCH(0x02,0x01,0x06,0x00,0xa3,0xe2,0xf4,0xf4),
+DUMP_TO_PATCH(0x21,0x61,0x1d,0x07,0x82,0x81,0x11,0x07),
+DUMP_TO_PATCH(0x23,0x21,0x22,0x17,0xa2,0x72,0x01,0x17),
+DUMP_TO_PATCH(0x35,0x11,0x25,0x00,0x40,0x73,0x72,0x01),
+DUMP_TO_PATCH(0xb5,0x01,0x0f,0x0F,0xa8,0xa5,0x51,0x02),
+DUMP_TO_PATCH(0x17,0xc1,0x24,0x07,0xf8,0xf8,0x22,0x12),
+DUMP_TO_PATCH(0x71,0x23,0x11,0x06,0x65,0x74,0x18,0x16),
+DUMP_TO_PATCH(0x01,0x02,0xd3,0x05,0xc9,0x95,0x03,0x02),
+DUMP_TO_PATCH(0x61,0x63,0x0c,0x00,0x94,0xC0,0x33,0xf6),
+DUMP_TO_PATCH(0x21,0x72,0x0d,0x00,0xc1,0xd5,0x56,0x06),
+DUMP_TO_PATCH(0x01,0x01,0x18,0x0f,0xdf,0xf8,0x6a,0x6d),
+DUMP_TO_PATCH(0x01,0x01,0x00,0x00,0xc8,0xd8,0xa7,0x68),
+DUMP_TO_PATCH(0x05,0x01,0x00,0x00,0xf8,0xaa,0x59,0x55),
 },{
 /* YMF281B presets */
-0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00, // 0: User
-0x62,0x21,0x1a,0x07,0xf0,0x6f,0x00,0x16, // 1: Electric Strings (form Chabin's patch)
-0x40,0x10,0x45,0x00,0xf6,0x83,0x73,0x63, // 2: Bow Wow (based on plgDavid's patch, KSL fixed)
-0x13,0x01,0x99,0x00,0xf2,0xc3,0x21,0x23, // 3: Electric Guitar (similar to YM2413 but different DR(C))
-0x01,0x61,0x0b,0x0f,0xf9,0x64,0x70,0x17, // 4: Organ (based on Chabin, TL/DR fixed)
-0x32,0x21,0x1e,0x06,0xe1,0x76,0x01,0x28, // 5: Clarinet (identical to YM2413)
-0x60,0x01,0x82,0x0e,0xf9,0x61,0x20,0x27, // 6: Saxophone (based on plgDavid, PM/EG fixed)
-0x21,0x61,0x1c,0x07,0x84,0x81,0x11,0x07, // 7: Trumpet (similar to YM2413 but different TL/DR(M))
-0x37,0x32,0xc9,0x01,0x66,0x64,0x40,0x28, // 8: Street Organ (from Chabin)
-0x01,0x21,0x07,0x03,0xa5,0x71,0x51,0x07, // 9: Synth Brass (based on Chabin, TL fixed)
-0x06,0x01,0x5e,0x07,0xf3,0xf3,0xf6,0x13, // A: Electric Piano (based on Chabin, DR/RR/KR fixed)
-0x00,0x00,0x18,0x06,0xf5,0xf3,0x20,0x23, // B: Bass (based on Chabin, EG fixed) 
-0x17,0xc1,0x24,0x07,0xf8,0xf8,0x22,0x12, // C: Vibraphone (identical to YM2413)
-0x35,0x64,0x00,0x00,0xff,0xf3,0x77,0xf5, // D: Chimes (from plgDavid)
-0x11,0x31,0x00,0x07,0xdd,0xf3,0xff,0xfb, // E: Tom Tom II (from plgDavid)
-0x3a,0x21,0x00,0x07,0x80,0x84,0x0f,0xf5, // F: Noise (based on plgDavid, AR fixed)
-0x01,0x01,0x18,0x0f,0xdf,0xf8,0x6a,0x6d, // R: Bass Drum (identical to YM2413)
-0x01,0x01,0x00,0x00,0xc8,0xd8,0xa7,0x68, // R: High-Hat(M) / Snare Drum(C) (identical to YM2413)
-0x05,0x01,0x00,0x00,0xf8,0xaa,0x59,0x55, // R: Tom-tom(M) / Top Cymbal(C) (identical to YM2413)
+DUMP_TO_PATCH(0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00), // 0: User
+DUMP_TO_PATCH(0x62,0x21,0x1a,0x07,0xf0,0x6f,0x00,0x16), // 1: Electric Strings (form Chabin's patch)
+DUMP_TO_PATCH(0x40,0x10,0x45,0x00,0xf6,0x83,0x73,0x63), // 2: Bow Wow (based on plgDavid's patch, KSL fixed)
+DUMP_TO_PATCH(0x13,0x01,0x99,0x00,0xf2,0xc3,0x21,0x23), // 3: Electric Guitar (similar to YM2413 but different DR(C))
+DUMP_TO_PATCH(0x01,0x61,0x0b,0x0f,0xf9,0x64,0x70,0x17), // 4: Organ (based on Chabin, TL/DR fixed)
+DUMP_TO_PATCH(0x32,0x21,0x1e,0x06,0xe1,0x76,0x01,0x28), // 5: Clarinet (identical to YM2413)
+DUMP_TO_PATCH(0x60,0x01,0x82,0x0e,0xf9,0x61,0x20,0x27), // 6: Saxophone (based on plgDavid, PM/EG fixed)
+DUMP_TO_PATCH(0x21,0x61,0x1c,0x07,0x84,0x81,0x11,0x07), // 7: Trumpet (similar to YM2413 but different TL/DR(M))
+DUMP_TO_PATCH(0x37,0x32,0xc9,0x01,0x66,0x64,0x40,0x28), // 8: Street Organ (from Chabin)
+DUMP_TO_PATCH(0x01,0x21,0x07,0x03,0xa5,0x71,0x51,0x07), // 9: Synth Brass (based on Chabin, TL fixed)
+DUMP_TO_PATCH(0x06,0x01,0x5e,0x07,0xf3,0xf3,0xf6,0x13), // A: Electric Piano (based on Chabin, DR/RR/KR fixed)
+DUMP_TO_PATCH(0x00,0x00,0x18,0x06,0xf5,0xf3,0x20,0x23), // B: Bass (based on Chabin, EG fixed) 
+DUMP_TO_PATCH(0x17,0xc1,0x24,0x07,0xf8,0xf8,0x22,0x12), // C: Vibraphone (identical to YM2413)
+DUMP_TO_PATCH(0x35,0x64,0x00,0x00,0xff,0xf3,0x77,0xf5), // D: Chimes (from plgDavid)
+DUMP_TO_PATCH(0x11,0x31,0x00,0x07,0xdd,0xf3,0xff,0xfb), // E: Tom Tom II (from plgDavid)
+DUMP_TO_PATCH(0x3a,0x21,0x00,0x07,0x80,0x84,0x0f,0xf5), // F: Noise (based on plgDavid, AR fixed)
+DUMP_TO_PATCH(0x01,0x01,0x18,0x0f,0xdf,0xf8,0x6a,0x6d), // R: Bass Drum (identical to YM2413)
+DUMP_TO_PATCH(0x01,0x01,0x00,0x00,0xc8,0xd8,0xa7,0x68), // R: High-Hat(M) / Snare Drum(C) (identical to YM2413)
+DUMP_TO_PATCH(0x05,0x01,0x00,0x00,0xf8,0xaa,0x59,0x55), // R: Tom-tom(M) / Top Cymbal(C) (identical to YM2413)
 }};
 /* clang-format on */
 
@@ -125,7 +146,7 @@ static uint8_t default_inst[OPLL_TONE_NUM][(16 + 3) * 8] = {{
 
 /* clang-format off */
 /* exp_table[x] = round((exp2((double)x / 256.0) - 1) * 1024) */
-static uint16_t exp_table[256] = {
+static const uint16_t exp_table[256] = {
 0,    3,    6,    8,    11,   14,   17,   20,   22,   25,   28,   31,   34,   37,   40,   42,
 45,   48,   51,   54,   57,   60,   63,   66,   69,   72,   75,   78,   81,   84,   87,   90,
 93,   96,   99,   102,  105,  108,  111,  114,  117,  120,  123,  126,  130,  133,  136,  139,
@@ -143,33 +164,50 @@ static uint16_t exp_table[256] = {
 854,  859,  864,  869,  874,  880,  885,  890,  895,  900,  906,  911,  916,  921,  927,  932,
 937,  942,  948,  953,  959,  964,  969,  975,  980,  986,  991,  996, 1002, 1007, 1013, 1018
 };
-/* fullsin_table[x] = round(-log2(sin((x + 0.5) * PI / (PG_WIDTH / 4) / 2)) * 256) */
-static uint16_t fullsin_table[PG_WIDTH] = {
-2137, 1731, 1543, 1419, 1326, 1252, 1190, 1137, 1091, 1050, 1013, 979,  949,  920,  894,  869, 
-846,  825,  804,  785,  767,  749,  732,  717,  701,  687,  672,  659,  646,  633,  621,  609, 
+/* sin_table[x] = round(-log2(sin((x + 0.5) * PI / (PG_WIDTH / 4) / 2)) * 256), a half of the wave. */
+/* the second half is given by wave_mask, see lookup_wave. */
+static const uint16_t sin_table[PG_WIDTH / 2] = {
+2137, 1731, 1543, 1419, 1326, 1252, 1190, 1137, 1091, 1050, 1013, 979,  949,  920,  894,  869,
+846,  825,  804,  785,  767,  749,  732,  717,  701,  687,  672,  659,  646,  633,  621,  609,
 598,  587,  576,  566,  556,  546,  536,  527,  518,  509,  501,  492,  484,  476,  468,  461,
-453,  446,  439,  432,  425,  418,  411,  405,  399,  392,  386,  380,  375,  369,  363,  358,  
+453,  446,  439,  432,  425,  418,  411,  405,  399,  392,  386,  380,  375,  369,  363,  358,
 352,  347,  341,  336,  331,  326,  321,  316,  311,  307,  302,  297,  293,  289,  284,  280,
-276,  271,  267,  263,  259,  255,  251,  248,  244,  240,  236,  233,  229,  226,  222,  219, 
-215,  212,  209,  205,  202,  199,  196,  193,  190,  187,  184,  181,  178,  175,  172,  169, 
-167,  164,  161,  159,  156,  153,  151,  148,  146,  143,  141,  138,  136,  134,  131,  129,  
-127,  125,  122,  120,  118,  116,  114,  112,  110,  108,  106,  104,  102,  100,  98,   96,   
+276,  271,  267,  263,  259,  255,  251,  248,  244,  240,  236,  233,  229,  226,  222,  219,
+215,  212,  209,  205,  202,  199,  196,  193,  190,  187,  184,  181,  178,  175,  172,  169,
+167,  164,  161,  159,  156,  153,  151,  148,  146,  143,  141,  138,  136,  134,  131,  129,
+127,  125,  122,  120,  118,  116,  114,  112,  110,  108,  106,  104,  102,  100,  98,   96,
 94,   92,   91,   89,   87,   85,   83,   82,   80,   78,   77,   75,   74,   72,   70,   69,
-67,   66,   64,   63,   62,   60,   59,   57,   56,   55,   53,   52,   51,   49,   48,   47,  
-46,   45,   43,   42,   41,   40,   39,   38,   37,   36,   35,   34,   33,   32,   31,   30,  
-29,   28,   27,   26,   25,   24,   23,   23,   22,   21,   20,   20,   19,   18,   17,   17,   
-16,   15,   15,   14,   13,   13,   12,   12,   11,   10,   10,   9,    9,    8,    8,    7,    
+67,   66,   64,   63,   62,   60,   59,   57,   56,   55,   53,   52,   51,   49,   48,   47,
+46,   45,   43,   42,   41,   40,   39,   38,   37,   36,   35,   34,   33,   32,   31,   30,
+29,   28,   27,   26,   25,   24,   23,   23,   22,   21,   20,   20,   19,   18,   17,   17,
+16,   15,   15,   14,   13,   13,   12,   12,   11,   10,   10,   9,    9,    8,    8,    7,
 7,    7,    6,    6,    5,    5,    5,    4,    4,    4,    3,    3,    3,    2,    2,    2,
 2,    1,    1,    1,    1,    1,    1,    1,    0,    0,    0,    0,    0,    0,    0,    0,
+0,    0,    0,    0,    0,    0,    0,    0,    1,    1,    1,    1,    1,    1,    1,    2,
+2,    2,    2,    3,    3,    3,    4,    4,    4,    5,    5,    5,    6,    6,    7,    7,
+7,    8,    8,    9,    9,    10,   10,   11,   12,   12,   13,   13,   14,   15,   15,   16,
+17,   17,   18,   19,   20,   20,   21,   22,   23,   23,   24,   25,   26,   27,   28,   29,
+30,   31,   32,   33,   34,   35,   36,   37,   38,   39,   40,   41,   42,   43,   45,   46,
+47,   48,   49,   51,   52,   53,   55,   56,   57,   59,   60,   62,   63,   64,   66,   67,
+69,   70,   72,   74,   75,   77,   78,   80,   82,   83,   85,   87,   89,   91,   92,   94,
+96,   98,   100,  102,  104,  106,  108,  110,  112,  114,  116,  118,  120,  122,  125,  127,
+129,  131,  134,  136,  138,  141,  143,  146,  148,  151,  153,  156,  159,  161,  164,  167,
+169,  172,  175,  178,  181,  184,  187,  190,  193,  196,  199,  202,  205,  209,  212,  215,
+219,  222,  226,  229,  233,  236,  240,  244,  248,  251,  255,  259,  263,  267,  271,  276,
+280,  284,  289,  293,  297,  302,  307,  311,  316,  321,  326,  331,  336,  341,  347,  352,
+358,  363,  369,  375,  380,  386,  392,  399,  405,  411,  418,  425,  432,  439,  446,  453,
+461,  468,  476,  484,  492,  501,  509,  518,  527,  536,  546,  556,  566,  576,  587,  598,
+609,  621,  633,  646,  659,  672,  687,  701,  717,  732,  749,  767,  785,  804,  825,  846,
+869,  894,  920,  949,  979,  1013, 1050, 1091, 1137, 1190, 1252, 1326, 1419, 1543, 1731, 2137,
 };
 /* clang-format on */
 
-static uint16_t halfsin_table[PG_WIDTH];
-static uint16_t *wave_table_map[2] = {fullsin_table, halfsin_table};
+/* wave_mask of each wave form: the second half of the full sine is negative, that of the half sine is silent. */
+static const uint16_t wave_mask_map[2] = {0x8000, 0x0fff};
 
 /* pitch modulator */
 /* offset to fnum, rough approximation of 14 cents depth. */
-static int8_t pm_table[8][8] = {
+static const int8_t pm_table[8][8] = {
     {0, 0, 0, 0, 0, 0, 0, 0},    // fnum = 000xxxxxx
     {0, 0, 1, 0, 0, 0, -1, 0},   // fnum = 001xxxxxx
     {0, 1, 2, 1, 0, -1, -2, -1}, // fnum = 010xxxxxx
@@ -183,7 +221,7 @@ static int8_t pm_table[8][8] = {
 /* amplitude lfo table */
 /* The following envelop pattern is verified on real YM2413. */
 /* each element repeates 64 cycles */
-static uint8_t am_table[210] = {0,  0,  0,  0,  0,  0,  0,  0,  1,  1,  1,  1,  1,  1,  1,  1,  //
+static const uint8_t am_table[210] = {0,  0,  0,  0,  0,  0,  0,  0,  1,  1,  1,  1,  1,  1,  1,  1,  //
                                 2,  2,  2,  2,  2,  2,  2,  2,  3,  3,  3,  3,  3,  3,  3,  3,  //
                                 4,  4,  4,  4,  4,  4,  4,  4,  5,  5,  5,  5,  5,  5,  5,  5,  //
                                 6,  6,  6,  6,  6,  6,  6,  6,  7,  7,  7,  7,  7,  7,  7,  7,  //
@@ -201,28 +239,190 @@ static uint8_t am_table[210] = {0,  0,  0,  0,  0,  0,  0,  0,  1,  1,  1,  1,
 
 /* envelope decay increment step table */
 /* based on andete's research */
-static uint8_t eg_step_tables[4][8] = {
+static const uint8_t eg_step_tables[4][8] = {
     {0, 1, 0, 1, 0, 1, 0, 1},
     {0, 1, 0, 1, 1, 1, 0, 1},
     {0, 1, 1, 1, 0, 1, 1, 1},
     {0, 1, 1, 1, 1, 1, 1, 1},
 };
 
+/*
+ * the steps of eg_step_tables for each [attack][eg_rate_h][eg_rate_l], used to find the next step of a sleeping
+ * envelope. nibble i is the step when (eg_counter >> eg_shift) & 15 == i: the increment of eg_out, or for the attack
+ * the shift of the decrement, 0 for none. The rates 12 to 15 step on every sample and take the step from the counter
+ * itself.
+ */
+static const uint64_t eg_step_pattern[2][16][4] = {
+    /* decay, sustain, release and damp */
+    {
+        {0x0000000000000000ull, 0x0000000000000000ull, 0x0000000000000000ull, 0x0000000000000000ull}, /* 0 */
+        {0x1010101010101010ull, 0x1011101010111010ull, 0x1110111011101110ull, 0x1111111011111110ull}, /* 1 */
+        {0x1010101010101010ull, 0x1011101010111010ull, 0x1110111011101110ull, 0x1111111011111110ull}, /* 2 */
+        {0x1010101010101010ull, 0x1011101010111010ull, 0x1110111011101110ull, 0x1111111011111110ull}, /* 3 */
+        {0x1010101010101010ull, 0x1011101010111010ull, 0x1110111011101110ull, 0x1111111011111110ull}, /* 4 */
+        {0x1010101010101010ull, 0x1011101010111010ull, 0x1110111011101110ull, 0x1111111011111110ull}, /* 5 */
+        {0x1010101010101010ull, 0x1011101010111010ull, 0x1110111011101110ull, 0x1111111011111110ull}, /* 6 */
+        {0x1010101010101010ull, 0x1011101010111010ull, 0x1110111011101110ull, 0x1111111011111110ull}, /* 7 */
+        {0x1010101010101010ull, 0x1011101010111010ull, 0x1110111011101110ull, 0x1111111011111110ull}, /* 8 */
+        {0x1010101010101010ull, 0x1011101010111010ull, 0x1110111011101110ull, 0x1111111011111110ull}, /* 9 */
+        {0x1010101010101010ull, 0x1011101010111010ull, 0x1110111011101110ull, 0x1111111011111110ull}, /* 10 */
+        {0x1010101010101010ull, 0x1011101010111010ull, 0x1110111011101110ull, 0x1111111011111110ull}, /* 11 */
+        {0x1010101010101010ull, 0x1011101010111010ull, 0x1110111011101110ull, 0x1111111011111110ull}, /* 12 */
+        {0x1010101010101010ull, 0x1010111110101010ull, 0x1111101011111010ull, 0x1111111111111010ull}, /* 13 */
+        {0x1111111111111111ull, 0x1111222211111111ull, 0x2222111122221111ull, 0x2222222222221111ull}, /* 14 */
+        {0x2222222222222222ull, 0x2222222222222222ull, 0x2222222222222222ull, 0x2222222222222222ull}, /* 15 */
+    },
+    /* attack */
+    {
+        {0x0000000000000000ull, 0x0000000000000000ull, 0x0000000000000000ull, 0x0000000000000000ull}, /* 0 */
+        {0x4040404040404040ull, 0x4044404040444040ull, 0x4440444044404440ull, 0x4444444044444440ull}, /* 1 */
+        {0x4040404040404040ull, 0x4044404040444040ull, 0x4440444044404440ull, 0x4444444044444440ull}, /* 2 */
+        {0x4040404040404040ull, 0x4044404040444040ull, 0x4440444044404440ull, 0x4444444044444440ull}, /* 3 */
+        {0x4040404040404040ull, 0x4044404040444040ull, 0x4440444044404440ull, 0x4444444044444440ull}, /* 4 */
+        {0x4040404040404040ull, 0x4044404040444040ull, 0x4440444044404440ull, 0x4444444044444440ull}, /* 5 */
+        {0x4040404040404040ull, 0x4044404040444040ull, 0x4440444044404440ull, 0x4444444044444440ull}, /* 6 */
+        {0x4040404040404040ull, 0x4044404040444040ull, 0x4440444044404440ull, 0x4444444044444440ull}, /* 7 */
+        {0x4040404040404040ull, 0x4044404040444040ull, 0x4440444044404440ull, 0x4444444044444440ull}, /* 8 */
+        {0x4040404040404040ull, 0x4044404040444040ull, 0x4440444044404440ull, 0x4444444044444440ull}, /* 9 */
+        {0x4040404040404040ull, 0x4044404040444040ull, 0x4440444044404440ull, 0x4444444044444440ull}, /* 10 */
+        {0x4040404040404040ull, 0x4044404040444040ull, 0x4440444044404440ull, 0x4444444044444440ull}, /* 11 */
+        {0x4444444444444444ull, 0x4444333344444444ull, 0x3333444433334444ull, 0x3333333333334444ull}, /* 12 */
+        {0x3333333333333333ull, 0x3333222233333333ull, 0x2222333322223333ull, 0x2222222222223333ull}, /* 13 */
+        {0x2222222222222222ull, 0x2222111122222222ull, 0x1111222211112222ull, 0x1111111111112222ull}, /* 14 */
+        {0x0000000000000000ull, 0x0000000000000000ull, 0x0000000000000000ull, 0x0000000000000000ull}, /* 15 */
+    },
+};
+
 enum __OPLL_EG_STATE { ATTACK, DECAY, SUSTAIN, RELEASE, DAMP, UNKNOWN };
 
-static uint32_t ml_table[16] = {1,     1 * 2, 2 * 2,  3 * 2,  4 * 2,  5 * 2,  6 * 2,  7 * 2,
-                                8 * 2, 9 * 2, 10 * 2, 10 * 2, 12 * 2, 12 * 2, 15 * 2, 15 * 2};
+static const uint8_t ml_table[16] = {1,     1 * 2, 2 * 2,  3 * 2,  4 * 2,  5 * 2,  6 * 2,  7 * 2,
+                                      8 * 2, 9 * 2, 10 * 2, 10 * 2, 12 * 2, 12 * 2, 15 * 2, 15 * 2};
+
+/* key scale level in EG steps, added to the total level: kl_table[blk_fnum >> 5][KL] */
+/* kl_table[(block << 4) | f][KL] = KL ? max(0, (int)(kl_dB[f] - 6 * (7 - block))) >> (3 - KL) / EG_STEP : 0 */
+/* kl_dB = {0, 18, 24, 27.75, 30, 32.25, 33.75, 35.25, 36, 37.5, 38.25, 39, 39.75, 40.5, 41.25, 42} */
+/* clang-format off */
+static const uint8_t kl_table[8 * 16][4] = {
+    {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0},
+    {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0},
+    {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0},
+    {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0},
+    {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0},
+    {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0},
+    {0, 0, 0, 0}, {0, 0, 0, 2}, {0, 0, 2, 5}, {0, 0, 2, 8},
+    {0, 0, 2, 8}, {0, 2, 5, 10}, {0, 2, 5, 13}, {0, 2, 8, 16},
+    {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0},
+    {0, 0, 0, 0}, {0, 0, 2, 5}, {0, 0, 2, 8}, {0, 2, 5, 13},
+    {0, 2, 8, 16}, {0, 2, 8, 18}, {0, 5, 10, 21}, {0, 5, 10, 24},
+    {0, 5, 10, 24}, {0, 5, 13, 26}, {0, 5, 13, 29}, {0, 8, 16, 32},
+    {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 2, 8},
+    {0, 2, 8, 16}, {0, 5, 10, 21}, {0, 5, 10, 24}, {0, 5, 13, 29},
+    {0, 8, 16, 32}, {0, 8, 16, 34}, {0, 8, 18, 37}, {0, 8, 18, 40},
+    {0, 8, 18, 40}, {0, 10, 21, 42}, {0, 10, 21, 45}, {0, 10, 24, 48},
+    {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 2, 8, 16}, {0, 5, 10, 24},
+    {0, 8, 16, 32}, {0, 8, 18, 37}, {0, 8, 18, 40}, {0, 10, 21, 45},
+    {0, 10, 24, 48}, {0, 10, 24, 50}, {0, 13, 26, 53}, {0, 13, 26, 56},
+    {0, 13, 26, 56}, {0, 13, 29, 58}, {0, 13, 29, 61}, {0, 16, 32, 64},
+    {0, 0, 0, 0}, {0, 2, 8, 16}, {0, 8, 16, 32}, {0, 8, 18, 40},
+    {0, 10, 24, 48}, {0, 13, 26, 53}, {0, 13, 26, 56}, {0, 13, 29, 61},
+    {0, 16, 32, 64}, {0, 16, 32, 66}, {0, 16, 34, 69}, {0, 16, 34, 72},
+    {0, 16, 34, 72}, {0, 18, 37, 74}, {0, 18, 37, 77}, {0, 18, 40, 80},
+    {0, 0, 0, 0}, {0, 8, 16, 32}, {0, 10, 24, 48}, {0, 13, 26, 56},
+    {0, 16, 32, 64}, {0, 16, 34, 69}, {0, 16, 34, 72}, {0, 18, 37, 77},
+    {0, 18, 40, 80}, {0, 18, 40, 82}, {0, 21, 42, 85}, {0, 21, 42, 88},
+    {0, 21, 42, 88}, {0, 21, 45, 90}, {0, 21, 45, 93}, {0, 24, 48, 96},
+    {0, 0, 0, 0}, {0, 10, 24, 48}, {0, 16, 32, 64}, {0, 16, 34, 72},
+    {0, 18, 40, 80}, {0, 21, 42, 85}, {0, 21, 42, 88}, {0, 21, 45, 93},
+    {0, 24, 48, 96}, {0, 24, 48, 98}, {0, 24, 50, 101}, {0, 24, 50, 104},
+    {0, 24, 50, 104}, {0, 26, 53, 106}, {0, 26, 53, 109}, {0, 26, 56, 112},
+};
+/* clang-format on */
 
-#define dB2(x) ((x)*2)
-static double kl_table[16] = {dB2(0.000),  dB2(9.000),  dB2(12.000), dB2(13.875), dB2(15.000), dB2(16.125),
-                              dB2(16.875), dB2(17.625), dB2(18.000), dB2(18.750), dB2(19.125), dB2(19.500),
-                              dB2(19.875), dB2(20.250), dB2(20.625), dB2(21.000)};
+/* key scale of EG rate: rks_table[blk_fnum >> 8][KR] */
+static const uint8_t rks_table[8 * 2][2] = {
+    {0, 0}, {0, 1}, {0, 2}, {0, 3}, {1, 4}, {1, 5}, {1, 6}, {1, 7},
+    {2, 8}, {2, 9}, {2, 10}, {2, 11}, {3, 12}, {3, 13}, {3, 14}, {3, 15},
+};
 
-static uint32_t tll_table[8 * 16][1 << TL_BITS][4];
-static int32_t rks_table[8 * 2][2];
+/* the noise LFSR advanced by 2^k cycles, as GF(2) matrices stored as columns. see jump_noise. */
+/* [0] shifts right and feeds bit 0 back to bits 22 and 8, and [k] is the square of [k - 1]. */
+#define NOISE_BITS 23
+#define NOISE_PERIOD ((1 << NOISE_BITS) - 1)
+/* clang-format off */
+static const uint32_t noise_jump_table[NOISE_BITS][NOISE_BITS] = {
+    {0x400100, 0x000001, 0x000002, 0x000004, 0x000008, 0x000010, 0x000020, 0x000040, 0x000080, 0x000100,
+     0x000200, 0x000400, 0x000800, 0x001000, 0x002000, 0x004000, 0x008000, 0x010000, 0x020000, 0x040000,
+     0x080000, 0x100000, 0x200000},
+    {0x200080, 0x400100, 0x000001, 0x000002, 0x000004, 0x000008, 0x000010, 0x000020, 0x000040, 0x000080,
+     0x000100, 0x000200, 0x000400, 0x000800, 0x001000, 0x002000, 0x004000, 0x008000, 0x010000, 0x020000,
+     0x040000, 0x080000, 0x100000},
+    {0x080020, 0x100040, 0x200080, 0x400100, 0x000001, 0x000002, 0x000004, 0x000008, 0x000010, 0x000020,
+     0x000040, 0x000080, 0x000100, 0x000200, 0x000400, 0x000800, 0x001000, 0x002000, 0x004000, 0x008000,
+     0x010000, 0x020000, 0x040000},
+    {0x008002, 0x010004, 0x020008, 0x040010, 0x080020, 0x100040, 0x200080, 0x400100, 0x000001, 0x000002,
+     0x000004, 0x000008, 0x000010, 0x000020, 0x000040, 0x000080, 0x000100, 0x000200, 0x000400, 0x000800,
+     0x001000, 0x002000, 0x004000},
+    {0x010084, 0x020108, 0x040210, 0x080420, 0x100840, 0x201080, 0x402100, 0x004001, 0x008002, 0x010004,
+     0x020008, 0x040010, 0x080020, 0x100040, 0x200080, 0x400100, 0x000001, 0x000002, 0x000004, 0x000008,
+     0x000010, 0x000020, 0x000040},
+    {0x044210, 0x088420, 0x110840, 0x221080, 0x442100, 0x084001, 0x108002, 0x210004, 0x420008, 0x040211,
+     0x080422, 0x100844, 0x201088, 0x402110, 0x004021, 0x008042, 0x010084, 0x020108, 0x040210, 0x080420,
+     0x100840, 0x201080, 0x402100},
+    {0x446120, 0x08c041, 0x118082, 0x230104, 0x460208, 0x0c0611, 0x180c22, 0x301844, 0x603088, 0x406311,
+     0x00c423, 0x018846, 0x03108c, 0x062118, 0x0c4230, 0x188460, 0x3108c0, 0x621180, 0x442101, 0x084003,
+     0x108006, 0x21000c, 0x420018},
+    {0x6074a8, 0x40eb51, 0x01d4a3, 0x03a946, 0x07528c, 0x0ea518, 0x1d4a30, 0x3a9460, 0x7528c0, 0x6a5381,
+     0x54a503, 0x294807, 0x52900e, 0x25221d, 0x4a443a, 0x148a75, 0x2914ea, 0x5229d4, 0x2451a9, 0x48a352,
+     0x1144a5, 0x22894a, 0x451294},
+    {0x3950ca, 0x72a194, 0x654129, 0x4a8053, 0x1502a7, 0x2a054e, 0x540a9c, 0x281739, 0x502e72, 0x205ee5,
+     0x40bdca, 0x017995, 0x02f32a, 0x05e654, 0x0bcca8, 0x179950, 0x2f32a0, 0x5e6540, 0x3cc881, 0x799102,
+     0x732005, 0x66420b, 0x4c8617},
+    {0x0ec24c, 0x1d8498, 0x3b0930, 0x761260, 0x6c26c1, 0x584f83, 0x309d07, 0x613a0e, 0x42761d, 0x04ee3b,
+     0x09dc76, 0x13b8ec, 0x2771d8, 0x4ee3b0, 0x1dc561, 0x3b8ac2, 0x771584, 0x6e2909, 0x5c5013, 0x38a227,
+     0x71444e, 0x628a9d, 0x45173b},
+    {0x55fcf2, 0x2bfbe5, 0x57f7ca, 0x2fed95, 0x5fdb2a, 0x3fb455, 0x7f68aa, 0x7ed355, 0x7da4ab, 0x7b4b57,
+     0x7694af, 0x6d2b5f, 0x5a54bf, 0x34ab7f, 0x6956fe, 0x52affd, 0x255dfb, 0x4abbf6, 0x1575ed, 0x2aebda,
+     0x55d7b4, 0x2bad69, 0x575ad2},
+    {0x363326, 0x6c664c, 0x58ce99, 0x319f33, 0x633e66, 0x467ecd, 0x0cff9b, 0x19ff36, 0x33fe6c, 0x67fcd8,
+     0x4ffbb1, 0x1ff563, 0x3feac6, 0x7fd58c, 0x7fa919, 0x7f5033, 0x7ea267, 0x7d46cf, 0x7a8f9f, 0x751d3f,
+     0x6a387f, 0x5472ff, 0x28e7ff},
+    {0x5f6836, 0x3ed26d, 0x7da4da, 0x7b4bb5, 0x76956b, 0x6d28d7, 0x5a53af, 0x34a55f, 0x694abe, 0x52977d,
+     0x252cfb, 0x4a59f6, 0x14b1ed, 0x2963da, 0x52c7b4, 0x258d69, 0x4b1ad2, 0x1637a5, 0x2c6f4a, 0x58de94,
+     0x31bf29, 0x637e52, 0x46fea5},
+    {0x37ebb6, 0x6fd76c, 0x5facd9, 0x3f5bb3, 0x7eb766, 0x7d6ccd, 0x7adb9b, 0x75b537, 0x6b686f, 0x56d2df,
+     0x2da7bf, 0x5b4f7e, 0x369cfd, 0x6d39fa, 0x5a71f5, 0x34e1eb, 0x69c3d6, 0x5385ad, 0x27095b, 0x4e12b6,
+     0x1c276d, 0x384eda, 0x709db4},
+    {0x1a6f94, 0x34df28, 0x69be50, 0x537ea1, 0x26ff43, 0x4dfe86, 0x1bff0d, 0x37fe1a, 0x6ffc34, 0x5ffa69,
+     0x3ff6d3, 0x7feda6, 0x7fd94d, 0x7fb09b, 0x7f6337, 0x7ec46f, 0x7d8adf, 0x7b17bf, 0x762d7f, 0x6c58ff,
+     0x58b3ff, 0x3165ff, 0x62cbfe},
+    {0x478d32, 0x0f1865, 0x1e30ca, 0x3c6194, 0x78c328, 0x718451, 0x630aa3, 0x461747, 0x0c2c8f, 0x18591e,
+     0x30b23c, 0x616478, 0x42caf1, 0x0597e3, 0x0b2fc6, 0x165f8c, 0x2cbf18, 0x597e30, 0x32fe61, 0x65fcc2,
+     0x4bfb85, 0x17f50b, 0x2fea16},
+    {0x252f04, 0x4a5e08, 0x14be11, 0x297c22, 0x52f844, 0x25f289, 0x4be512, 0x17c825, 0x2f904a, 0x5f2094,
+     0x3e4329, 0x7c8652, 0x790ea5, 0x721f4b, 0x643c97, 0x487b2f, 0x10f45f, 0x21e8be, 0x43d17c, 0x07a0f9,
+     0x0f41f2, 0x1e83e4, 0x3d07c8},
+    {0x197238, 0x32e470, 0x65c8e0, 0x4b93c1, 0x172583, 0x2e4b06, 0x5c960c, 0x392e19, 0x725c32, 0x64ba65,
+     0x4976cb, 0x12ef97, 0x25df2e, 0x4bbe5c, 0x177eb9, 0x2efd72, 0x5dfae4, 0x3bf7c9, 0x77ef92, 0x6fdd25,
+     0x5fb84b, 0x3f7297, 0x7ee52e},
+    {0x02c760, 0x058ec0, 0x0b1d80, 0x163b00, 0x2c7600, 0x58ec00, 0x31da01, 0x63b402, 0x476a05, 0x0ed60b,
+     0x1dac16, 0x3b582c, 0x76b058, 0x6d62b1, 0x5ac763, 0x358cc7, 0x6b198e, 0x56311d, 0x2c603b, 0x58c076,
+     0x3182ed, 0x6305da, 0x4609b5},
+    {0x045ca0, 0x08b940, 0x117280, 0x22e500, 0x45ca00, 0x0b9601, 0x172c02, 0x2e5804, 0x5cb008, 0x396211,
+     0x72c422, 0x658a45, 0x4b168b, 0x162f17, 0x2c5e2e, 0x58bc5c, 0x317ab9, 0x62f572, 0x45e8e5, 0x0bd3cb,
+     0x17a796, 0x2f4f2c, 0x5e9e58},
+    {0x102022, 0x204044, 0x408088, 0x010311, 0x020622, 0x040c44, 0x081888, 0x103110, 0x206220, 0x40c440,
+     0x018a81, 0x031502, 0x062a04, 0x0c5408, 0x18a810, 0x315020, 0x62a040, 0x454281, 0x0a8703, 0x150e06,
+     0x2a1c0c, 0x543818, 0x287231},
+    {0x020404, 0x040808, 0x081010, 0x102020, 0x204040, 0x408080, 0x010301, 0x020602, 0x040c04, 0x081808,
+     0x103010, 0x206020, 0x40c040, 0x018281, 0x030502, 0x060a04, 0x0c1408, 0x182810, 0x305020, 0x60a040,
+     0x414281, 0x028703, 0x050e06},
+    {0x000810, 0x001020, 0x002040, 0x004080, 0x008100, 0x010200, 0x020400, 0x040800, 0x081000, 0x102000,
+     0x204000, 0x408000, 0x010201, 0x020402, 0x040804, 0x081008, 0x102010, 0x204020, 0x408040, 0x010281,
+     0x020502, 0x040a04, 0x081408},
+};
+/* clang-format on */
 
-static OPLL_PATCH null_patch = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-static OPLL_PATCH default_patch[OPLL_TONE_NUM][(16 + 3) * 2];
+static const OPLL_PATCH null_patch = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 
 /* don't forget min/max is defined as a macro in stdlib.h of Visual C. */
 #ifndef min
@@ -232,6 +432,65 @@ static INLINE int min(int i, int j) { return (i < j) ? i : j; }
 static INLINE int max(int i, int j) { return (i > j) ? i : j; }
 #endif
 
+/***************************************************
+
+                 Memory Allocation
+
+****************************************************/
+
+static void *default_alloc(size_t size, void *user) {
+  (void)user;
+  return malloc(size);
+}
+
+static void default_free(void *ptr, void *user) {
+  (void)user;
+  free(ptr);
+}
+
+static void *(*alloc_func)(size_t size, void *user) = default_alloc;
+static void (*free_func)(void *ptr, void *user) = default_free;
+static void *alloc_user = NULL;
+
+void OPLL_setAllocator(void *(*alloc)(size_t size, void *user), void (*release)(void *ptr, void *user), void *user) {
+  if (alloc == NULL || release == NULL) {
+    alloc_func = default_alloc;
+    free_func = default_free;
+    alloc_user = NULL;
+  } else {
+    alloc_func = alloc;
+    free_func = release;
+    alloc_user = user;
+  }
+}
+
+static void *opll_alloc(size_t size) { return alloc_func(size, alloc_user); }
+
+static void opll_free(void *ptr) {
+  if (ptr != NULL)
+    free_func(ptr, alloc_user);
+}
+
+/* memory aligned to OPLL_ALIGN. the pointer returned by the allocator is kept just before the aligned block. */
+static void *opll_alloc_aligned(size_t size) {
+  uint8_t *ptr = (uint8_t *)opll_alloc(size + OPLL_ALIGN + sizeof(void *));
+  uint8_t *aligned;
+  if (ptr == NULL)
+    return NULL;
+  aligned = ptr + sizeof(void *);
+  aligned += (OPLL_ALIGN - (uintptr_t)aligned % OPLL_ALIGN) % OPLL_ALIGN;
+  memcpy(aligned - sizeof(void *), &ptr, sizeof(void *));
+  return aligned;
+}
+
+static void opll_free_aligned(void *ptr) {
+  void *base;
+  if (ptr == NULL)
+    return;
+  memcpy(&base, (uint8_t *)ptr - sizeof(void *), sizeof(void *));
+  opll_free(base);
+}
+
 /***************************************************
 
            Internal Sample Rate Converter
@@ -240,176 +499,605 @@ static INLINE int max(int i, int j) { return (i > j) ? i : j; }
 /* Note: to disable internal rate converter, set clock/72 to output sampling rate. */
 
 /*
- * LW is truncate length of sinc(x) calculation.
+ * LW is the default truncate length of sinc(x) calculation.
  * Lower LW is faster, higher LW results better quality.
- * LW must be a non-zero positive even number, no upper limit.
+ * LW must be a non-zero positive even number.
  * LW=16 or greater is recommended when upsampling.
  * LW=8 is practically okay for downsampling.
+ * The length can be changed per converter with OPLL_RateConvConfig.
  */
 #define LW 16
+#define LW_MAX 64
 
 /* resolution of sinc(x) table. sinc(x) where 0.0<=x<1.0 corresponds to sinc_table[0...SINC_RESO-1] */
 #define SINC_RESO 256
 #define SINC_AMP_BITS 12
 
-// double hamming(double x) { return 0.54 - 0.46 * cos(2 * PI * x); }
+static double hamming(double x) { return 0.54 - 0.46 * cos(2 * _PI_ * x); }
 static double blackman(double x) { return 0.42 - 0.5 * cos(2 * _PI_ * x) + 0.08 * cos(4 * _PI_ * x); }
 static double sinc(double x) { return (x == 0.0 ? 1.0 : sin(_PI_ * x) / (_PI_ * x)); }
-static double windowed_sinc(double x) { return blackman(0.5 + 0.5 * x / (LW / 2)) * sinc(x); }
+/* half: distance from the center to the end of the window */
+static double windowed_sinc(double x, int half, int window) {
+  const double w = 0.5 + 0.5 * x / half;
+  return (window == OPLL_RATECONV_HAMMING ? hamming(w) : blackman(w)) * sinc(x);
+}
 
-/* f_inp: input frequency. f_out: output frequencey, ch: number of channels */
-OPLL_RateConv *OPLL_RateConv_new(double f_inp, double f_out, int ch) {
-  OPLL_RateConv *conv = malloc(sizeof(OPLL_RateConv));
-  int i;
+/* Catmull-Rom spline */
+static double cubic(double x) {
+  x = fabs(x);
+  if (x < 1.0)
+    return 1.5 * x * x * x - 2.5 * x * x + 1.0;
+  if (x < 2.0)
+    return -0.5 * x * x * x + 2.5 * x * x - 4.0 * x + 2.0;
+  return 0.0;
+}
+
+/*
+ * The history of each channel is a ring buffer of `taps` samples which is stored twice in a row, so the latest
+ * samples are always readable as a contiguous array without shifting the history on every input.
+ * Histories of all channels and their write positions are kept in one allocation aligned to RATECONV_ALIGN bytes.
+ * Rows of the filter bank are zero-padded to `stride` (a multiple of RATECONV_TAP_ALIGN) taps, and the history of
+ * each channel has `stride - taps` extra samples so that a whole padded row can be read from any position.
+ *
+ * Converters of more than RATECONV_PLANAR_MAX channels keep one history of frames instead, with the channels of each
+ * frame interleaved and zero-padded to `width`. All channels are then filtered at once, one vector lane per channel,
+ * and no horizontal sum is needed. Fewer channels would leave most lanes empty, so they use the planar layout where
+ * the lanes run over the taps.
+ */
+#define RATECONV_ALIGN 64
+#define RATECONV_TAP_ALIGN 8
+#define RATECONV_PLANAR_MAX 2
+
+void OPLL_RateConv_getDefaultConfig(OPLL_RateConvConfig *config) {
+  config->kernel = OPLL_RATECONV_SINC;
+  config->taps = LW;
+  config->window = OPLL_RATECONV_BLACKMAN;
+  config->amp_bits = SINC_AMP_BITS;
+  config->lookahead = 0;
+}
+
+/*
+ * Polyphase filter bank.
+ * The fractional position of the output sample between input samples is quantized to SINC_RESO phases.
+ * coef[phase * stride + k] is the weight of the k-th oldest input sample for the phase.
+ * The position is tracked by an exact rational accumulator: the fraction is (phase * den + rem) / (SINC_RESO * den)
+ * and it advances by num / den input samples per output sample.
+ *
+ * The interpolation point is placed `lookahead` taps before the latest sample. lookahead = taps / 2 gives a
+ * linear-phase filter; smaller values cut the delay with an asymmetric window, which is one-sided toward the newer
+ * samples and keeps the full length toward the older ones.
+ *
+ * Filter banks are shared by all converters with the same settings through a process-wide reference-counted cache.
+ * The ratio is a part of the key only for downsampling with OPLL_RATECONV_SINC; other banks do not depend on it.
+ */
+struct __OPLL_RateConvCoef {
+  struct __OPLL_RateConvCoef *next;
+  uint32_t refcount;
+  uint32_t num;
+  uint32_t den;
+  int kernel;
+  int taps;
+  int window;
+  int amp_bits;
+  int lookahead;
+  int16_t *coef;
+};
+
+static struct __OPLL_RateConvCoef *coef_cache = NULL;
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+static volatile long coef_cache_lock = 0;
+#define LOCK_COEF_CACHE()                                                                                            \
+  while (_InterlockedExchange(&coef_cache_lock, 1))                                                                  \
+    ;
+#define UNLOCK_COEF_CACHE() _InterlockedExchange(&coef_cache_lock, 0)
+#elif defined(__GNUC__)
+static volatile int coef_cache_lock = 0;
+#define LOCK_COEF_CACHE()                                                                                            \
+  while (__sync_lock_test_and_set(&coef_cache_lock, 1))                                                             \
+    ;
+#define UNLOCK_COEF_CACHE() __sync_lock_release(&coef_cache_lock)
+#else
+/* no atomic operation available: converters must not be created or deleted concurrently. */
+#define LOCK_COEF_CACHE()
+#define UNLOCK_COEF_CACHE()
+#endif
+
+static void make_coef_table(struct __OPLL_RateConvCoef *e, int stride) {
+  const double ratio = (double)e->num / e->den;
+  const double amp = (double)(1 << e->amp_bits);
+  const int center = e->taps - e->lookahead - 1;
+  int p, k;
+
+  memset(e->coef, 0, sizeof(e->coef[0]) * SINC_RESO * stride);
+  for (p = 0; p < SINC_RESO; p++) {
+    for (k = 0; k < e->taps; k++) {
+      const int32_t d = k - center;
+      double v;
+      if (e->kernel == OPLL_RATECONV_SINC) {
+        /*
+         * The tap is located at x = d - (p + e) / SINC_RESO where 0 <= e < 1.
+         * The table index is |x| * SINC_RESO truncated toward zero.
+         */
+        const int32_t index = (d > 0) ? (d * SINC_RESO - p - 1) : (-d * SINC_RESO + p);
+        const double x = (double)index / SINC_RESO;
+        const int half = (d > 0) ? e->lookahead : e->taps - e->lookahead;
+        if (ratio > 1.0) {
+          /* for downsampling */
+          v = windowed_sinc(x / ratio, half, e->window) / ratio;
+        } else {
+          /* for upsampling */
+          v = windowed_sinc(x, half, e->window);
+        }
+      } else {
+        /* interpolation at the center of the phase */
+        const double x = d - (p + 0.5) / SINC_RESO;
+        if (e->kernel == OPLL_RATECONV_CUBIC) {
+          v = cubic(x);
+        } else {
+          v = fabs(x) < 1.0 ? 1.0 - fabs(x) : 0.0;
+        }
+      }
+      e->coef[p * stride + k] = (int16_t)(amp * v);
+    }
+  }
+}
+
+static uint32_t gcd(uint32_t a, uint32_t b) {
+  while (b) {
+    uint32_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+/* reduce the ratio num/den to the key of the filter bank. */
+static void get_coef_key(const OPLL_RateConv *conv, uint32_t *num, uint32_t *den) {
+  const uint32_t g = gcd(*num, *den);
+  *num /= g;
+  *den /= g;
+  if (conv->kernel != OPLL_RATECONV_SINC || *num <= *den) {
+    *num = *den = 1;
+  }
+}
+
+static INLINE int coef_table_matches(const struct __OPLL_RateConvCoef *e, const OPLL_RateConv *conv, uint32_t num,
+                                     uint32_t den) {
+  return e->num == num && e->den == den && e->kernel == conv->kernel && e->taps == conv->taps &&
+         e->window == conv->window && e->amp_bits == conv->amp_bits && e->lookahead == conv->lookahead;
+}
+
+/* the caller must hold the lock of the cache. */
+static struct __OPLL_RateConvCoef *find_coef_table(const OPLL_RateConv *conv, uint32_t num, uint32_t den) {
+  struct __OPLL_RateConvCoef *e;
+  for (e = coef_cache; e; e = e->next) {
+    if (coef_table_matches(e, conv, num, den))
+      break;
+  }
+  return e;
+}
+
+/* num/den is a key given by get_coef_key. */
+static struct __OPLL_RateConvCoef *acquire_coef_table(const OPLL_RateConv *conv, uint32_t num, uint32_t den) {
+  struct __OPLL_RateConvCoef *e, *found;
+
+  LOCK_COEF_CACHE();
+  found = find_coef_table(conv, num, den);
+  if (found)
+    found->refcount++;
+  UNLOCK_COEF_CACHE();
+  if (found)
+    return found;
+
+  /* the bank is built outside of the lock, so that other threads are not blocked on lookups meanwhile. */
+  e = opll_alloc(sizeof(struct __OPLL_RateConvCoef) + sizeof(e->coef[0]) * SINC_RESO * conv->stride);
+  if (e == NULL)
+    return NULL;
+  e->refcount = 1;
+  e->num = num;
+  e->den = den;
+  e->kernel = conv->kernel;
+  e->taps = conv->taps;
+  e->window = conv->window;
+  e->amp_bits = conv->amp_bits;
+  e->lookahead = conv->lookahead;
+  e->coef = (int16_t *)(e + 1);
+  make_coef_table(e, conv->stride);
+
+  LOCK_COEF_CACHE();
+  found = find_coef_table(conv, num, den);
+  if (found) {
+    found->refcount++;
+  } else {
+    e->next = coef_cache;
+    coef_cache = e;
+  }
+  UNLOCK_COEF_CACHE();
+  if (found) {
+    /* another thread has built the same bank in the meantime. */
+    opll_free(e);
+    return found;
+  }
+  return e;
+}
+
+static void release_coef_table(struct __OPLL_RateConvCoef *entry) {
+  struct __OPLL_RateConvCoef **p;
+
+  LOCK_COEF_CACHE();
+  if (--entry->refcount == 0) {
+    for (p = &coef_cache; *p; p = &(*p)->next) {
+      if (*p == entry) {
+        *p = entry->next;
+        break;
+      }
+    }
+  } else {
+    entry = NULL;
+  }
+  UNLOCK_COEF_CACHE();
+  opll_free(entry);
+}
+
+/* number of samples in the history of all channels */
+static INLINE size_t rate_conv_buf_len(const OPLL_RateConv *conv) {
+  return (size_t)conv->hist_len * (conv->width ? conv->width : conv->ch);
+}
+
+/* allocate a converter without filter bank. The memory depends only on ch and config, not on the ratio. */
+static OPLL_RateConv *rate_conv_alloc(int ch, const OPLL_RateConvConfig *config) {
+  OPLL_RateConv *conv;
+  OPLL_RateConvConfig def;
+  size_t head_size;
+
+  if (config == NULL) {
+    OPLL_RateConv_getDefaultConfig(&def);
+    config = &def;
+  }
+
+  conv = opll_alloc(sizeof(OPLL_RateConv));
+  if (conv == NULL)
+    return NULL;
+  conv->coef = NULL;
+  conv->coef_entry = NULL;
+
+  conv->kernel = config->kernel;
+  if (conv->kernel == OPLL_RATECONV_LINEAR) {
+    conv->taps = 2;
+  } else if (conv->kernel == OPLL_RATECONV_CUBIC) {
+    conv->taps = 4;
+  } else {
+    conv->kernel = OPLL_RATECONV_SINC;
+    conv->taps = min(LW_MAX, max(2, config->taps & ~1));
+  }
+  conv->window = (conv->kernel == OPLL_RATECONV_SINC) ? config->window : 0;
+  conv->stride = (conv->taps + RATECONV_TAP_ALIGN - 1) & ~(RATECONV_TAP_ALIGN - 1);
+  conv->amp_bits = min(14, max(6, config->amp_bits));
+  if (ch > RATECONV_PLANAR_MAX) {
+    conv->width = (ch + RATECONV_TAP_ALIGN - 1) & ~(RATECONV_TAP_ALIGN - 1);
+    conv->hist_len = conv->taps * 2;
+  } else {
+    conv->width = 0;
+    conv->hist_len = conv->taps + conv->stride;
+  }
+  conv->lookahead = conv->taps / 2;
+  if (conv->kernel == OPLL_RATECONV_SINC && config->lookahead > 0) {
+    conv->lookahead = min(conv->taps / 2, config->lookahead);
+  }
 
   conv->ch = ch;
-  conv->f_ratio = f_inp / f_out;
-  conv->buf = malloc(sizeof(void *) * ch);
-  for (i = 0; i < ch; i++) {
-    conv->buf[i] = malloc(sizeof(conv->buf[0][0]) * LW);
-  }
-
-  /* create sinc_table for positive 0 <= x < LW/2 */
-  conv->sinc_table = malloc(sizeof(conv->sinc_table[0]) * SINC_RESO * LW / 2);
-  for (i = 0; i < SINC_RESO * LW / 2; i++) {
-    const double x = (double)i / SINC_RESO;
-    if (f_out < f_inp) {
-      /* for downsampling */
-      conv->sinc_table[i] = (int16_t)((1 << SINC_AMP_BITS) * windowed_sinc(x / conv->f_ratio) / conv->f_ratio);
+  conv->num = conv->den = 1;
+  conv->step_phase = conv->step_rem = 0;
+
+  head_size = (sizeof(conv->head[0]) * ch + RATECONV_ALIGN - 1) & ~(size_t)(RATECONV_ALIGN - 1);
+  conv->mem = opll_alloc(RATECONV_ALIGN + head_size + sizeof(conv->buf[0]) * rate_conv_buf_len(conv));
+  if (conv->mem == NULL) {
+    opll_free(conv);
+    return NULL;
+  }
+  conv->head = (uint32_t *)(((uintptr_t)conv->mem + RATECONV_ALIGN - 1) & ~(uintptr_t)(RATECONV_ALIGN - 1));
+  conv->buf = (int16_t *)((uint8_t *)conv->head + head_size);
+
+  OPLL_RateConv_reset(conv);
+
+  return conv;
+}
+
+/*
+ * Set the ratio of input/output frequency as num/den. The caller resets the converter afterwards.
+ * The filter bank is replaced only if it depends on the ratio. `spare` optionally holds another bank owned by the
+ * caller: it is swapped in if it fits the ratio, and otherwise it takes over the replaced bank, so that switching
+ * between two ratios neither allocates nor builds a bank after the first time.
+ * Returns 0 if no bank is available for the ratio.
+ */
+static int rate_conv_set_ratio(OPLL_RateConv *conv, uint32_t num, uint32_t den, struct __OPLL_RateConvCoef **spare) {
+  struct __OPLL_RateConvCoef *e = conv->coef_entry;
+  const uint32_t g = gcd(num, den);
+  uint32_t key_num = num, key_den = den;
+  uint64_t step;
+
+  get_coef_key(conv, &key_num, &key_den);
+  if (e == NULL || !coef_table_matches(e, conv, key_num, key_den)) {
+    if (spare && *spare && coef_table_matches(*spare, conv, key_num, key_den)) {
+      e = *spare;
+      *spare = conv->coef_entry;
     } else {
-      /* for upsampling */
-      conv->sinc_table[i] = (int16_t)((1 << SINC_AMP_BITS) * windowed_sinc(x));
+      e = acquire_coef_table(conv, key_num, key_den);
+      if (e == NULL)
+        return 0;
+      if (spare) {
+        if (*spare)
+          release_coef_table(*spare);
+        *spare = conv->coef_entry;
+      } else if (conv->coef_entry) {
+        release_coef_table(conv->coef_entry);
+      }
     }
+    conv->coef_entry = e;
+    conv->coef = e->coef;
   }
 
+  conv->num = num / g;
+  conv->den = den / g;
+  step = (uint64_t)(conv->num % conv->den) * SINC_RESO;
+  conv->step_phase = (uint32_t)(step / conv->den);
+  conv->step_rem = (uint32_t)(step % conv->den);
+  return 1;
+}
+
+/* ratio of input/output frequency as num/den. */
+static OPLL_RateConv *rate_conv_new(uint32_t num, uint32_t den, int ch, const OPLL_RateConvConfig *config) {
+  OPLL_RateConv *conv = rate_conv_alloc(ch, config);
+  if (conv != NULL && !rate_conv_set_ratio(conv, num, den, NULL)) {
+    OPLL_RateConv_delete(conv);
+    return NULL;
+  }
   return conv;
 }
 
-static INLINE int16_t lookup_sinc_table(int16_t *table, double x) {
-  int16_t index = (int16_t)(x * SINC_RESO);
-  if (index < 0)
-    index = -index;
-  return table[min(SINC_RESO * LW / 2 - 1, index)];
+/* approximate x by a fraction whose terms do not exceed limit. */
+static void approximate_ratio(double x, uint32_t limit, uint32_t *num, uint32_t *den) {
+  uint64_t h0 = 0, h1 = 1, k0 = 1, k1 = 0;
+  int i;
+  for (i = 0; i < 64; i++) {
+    const double a = floor(x);
+    const uint64_t h = (uint64_t)a * h1 + h0;
+    const uint64_t k = (uint64_t)a * k1 + k0;
+    if (h > limit || k > limit)
+      break;
+    h0 = h1;
+    h1 = h;
+    k0 = k1;
+    k1 = k;
+    if (x - a < 1e-12)
+      break;
+    x = 1.0 / (x - a);
+  }
+  *num = (uint32_t)max(1, (int)h1);
+  *den = (uint32_t)max(1, (int)k1);
+}
+
+/* f_inp: input frequency. f_out: output frequencey, ch: number of channels */
+OPLL_RateConv *OPLL_RateConv_new(double f_inp, double f_out, int ch) {
+  return OPLL_RateConv_newWithConfig(f_inp, f_out, ch, NULL);
+}
+
+OPLL_RateConv *OPLL_RateConv_newWithConfig(double f_inp, double f_out, int ch, const OPLL_RateConvConfig *config) {
+  uint32_t num, den;
+  approximate_ratio(f_inp / f_out, 0x7fffffff, &num, &den);
+  return rate_conv_new(num, den, ch, config);
 }
 
 void OPLL_RateConv_reset(OPLL_RateConv *conv) {
   int i;
-  conv->timer = 0;
+  conv->phase = 0;
+  conv->rem = 0;
   for (i = 0; i < conv->ch; i++) {
-    memset(conv->buf[i], 0, sizeof(conv->buf[i][0]) * LW);
+    conv->head[i] = conv->taps - 1;
   }
+  memset(conv->buf, 0, sizeof(conv->buf[0]) * rate_conv_buf_len(conv));
 }
 
 /* put original data to this converter at f_inp. */
+/* if the converter has more than two channels, the channels of each input sample must be put in order. */
 void OPLL_RateConv_putData(OPLL_RateConv *conv, int ch, int16_t data) {
-  int16_t *buf = conv->buf[ch];
+  uint32_t pos = conv->head[conv->width ? 0 : ch] + 1;
+  if (pos == (uint32_t)conv->taps)
+    pos = 0;
+  if (conv->width) {
+    conv->buf[pos * conv->width + ch] = conv->buf[(pos + conv->taps) * conv->width + ch] = data;
+    if (ch == conv->ch - 1)
+      conv->head[0] = pos;
+  } else {
+    int16_t *buf = conv->buf + conv->hist_len * ch;
+    buf[pos] = buf[pos + conv->taps] = data;
+    conv->head[ch] = pos;
+  }
+}
+
+/* put one sample of every channel. */
+void OPLL_RateConv_putFrame(OPLL_RateConv *conv, const int16_t *data) {
+  uint32_t pos;
   int i;
-  for (i = 0; i < LW - 1; i++) {
-    buf[i] = buf[i + 1];
+
+  if (conv->width == 0) {
+    for (i = 0; i < conv->ch; i++) {
+      OPLL_RateConv_putData(conv, i, data[i]);
+    }
+    return;
   }
-  buf[LW - 1] = data;
+
+  pos = conv->head[0] + 1;
+  if (pos == (uint32_t)conv->taps)
+    pos = 0;
+  memcpy(conv->buf + pos * conv->width, data, sizeof(data[0]) * conv->ch);
+  memcpy(conv->buf + (pos + conv->taps) * conv->width, data, sizeof(data[0]) * conv->ch);
+  conv->head[0] = pos;
 }
 
-/* get resampled data from this converter at f_out. */
-/* this function must be called f_out / f_inp times per one putData call. */
-int16_t OPLL_RateConv_getData(OPLL_RateConv *conv, int ch) {
-  int16_t *buf = conv->buf[ch];
+/*
+ * dot product of `n` history samples and a row of the filter bank. n is a multiple of RATECONV_TAP_ALIGN.
+ * This and fir_dot2 are left to the compiler: hand-written SSE2 and AVX2 versions were not measurably faster than
+ * what it vectorizes by itself, see bench/fir_bench.c.
+ */
+static INLINE int32_t fir_dot(const int16_t *buf, const int16_t *coef, int n) {
   int32_t sum = 0;
   int k;
-  double dn;
-  conv->timer += conv->f_ratio;
-  dn = conv->timer - floor(conv->timer);
-  conv->timer = dn;
-
-  for (k = 0; k < LW; k++) {
-    double x = ((double)k - (LW / 2 - 1)) - dn;
-    sum += buf[k] * lookup_sinc_table(conv->sinc_table, x);
+  for (k = 0; k < n; k++) {
+    sum += buf[k] * coef[k];
   }
-  return sum >> SINC_AMP_BITS;
+  return sum;
 }
 
-void OPLL_RateConv_delete(OPLL_RateConv *conv) {
-  int i;
-  for (i = 0; i < conv->ch; i++) {
-    free(conv->buf[i]);
+/* same as fir_dot, but for two channels sharing the same row of the filter bank. */
+static INLINE void fir_dot2(const int16_t *buf0, const int16_t *buf1, const int16_t *coef, int n, int32_t sum[2]) {
+  int k;
+  sum[0] = sum[1] = 0;
+  for (k = 0; k < n; k++) {
+    sum[0] += buf0[k] * coef[k];
+    sum[1] += buf1[k] * coef[k];
   }
-  free(conv->buf);
-  free(conv->sinc_table);
-  free(conv);
 }
 
-/***************************************************
-
-                  Create tables
-
-****************************************************/
+static INLINE void advance_rate_conv(OPLL_RateConv *conv) {
+  conv->rem += conv->step_rem;
+  conv->phase += conv->step_phase;
+  if (conv->rem >= conv->den) {
+    conv->rem -= conv->den;
+    conv->phase++;
+  }
+  conv->phase &= SINC_RESO - 1;
+}
 
-static void makeSinTable(void) {
-  int x;
+/* skip `inputs` samples of the first `ch` channels and `outputs` output samples without touching the history. */
+static void skip_rate_conv(OPLL_RateConv *conv, int ch, uint64_t inputs, uint64_t outputs) {
+  const uint64_t rem = outputs * conv->step_rem + conv->rem;
+  int i;
 
-  for (x = 0; x < PG_WIDTH / 4; x++) {
-    fullsin_table[PG_WIDTH / 4 + x] = fullsin_table[PG_WIDTH / 4 - x - 1];
+  conv->phase = (uint32_t)((conv->phase + outputs * conv->step_phase + rem / conv->den) & (SINC_RESO - 1));
+  conv->rem = (uint32_t)(rem % conv->den);
+  for (i = 0; i < (conv->width ? 1 : ch); i++) {
+    conv->head[i] = (uint32_t)((conv->head[i] + inputs) % conv->taps);
   }
+}
 
-  for (x = 0; x < PG_WIDTH / 2; x++) {
-    fullsin_table[PG_WIDTH / 2 + x] = 0x8000 | fullsin_table[x];
+/* portable version of fir_dot_frames, used without SIMD and as the reference in tests/fir_test.c */
+static INLINE void fir_dot_frames_c(const OPLL_RateConv *conv, const int16_t *hist, const int16_t *coef, int16_t *out) {
+  int c, k;
+  for (c = 0; c < conv->ch; c++) {
+    int32_t sum = 0;
+    for (k = 0; k < conv->taps; k++) {
+      sum += hist[k * conv->width + c] * coef[k];
+    }
+    out[c] = sum >> conv->amp_bits;
   }
-
-  for (x = 0; x < PG_WIDTH / 2; x++)
-    halfsin_table[x] = fullsin_table[x];
-
-  for (x = PG_WIDTH / 2; x < PG_WIDTH; x++)
-    halfsin_table[x] = 0xfff;
 }
 
-static void makeTllTable(void) {
-
-  int32_t tmp;
-  int32_t fnum, block, TL, KL;
-
-  for (fnum = 0; fnum < 16; fnum++) {
-    for (block = 0; block < 8; block++) {
-      for (TL = 0; TL < 64; TL++) {
-        for (KL = 0; KL < 4; KL++) {
-          if (KL == 0) {
-            tll_table[(block << 4) | fnum][TL][KL] = TL2EG(TL);
-          } else {
-            tmp = (int32_t)(kl_table[fnum] - dB2(3.000) * (7 - block));
-            if (tmp <= 0)
-              tll_table[(block << 4) | fnum][TL][KL] = TL2EG(TL);
-            else
-              tll_table[(block << 4) | fnum][TL][KL] = (uint32_t)((tmp >> (3 - KL)) / EG_STEP) + TL2EG(TL);
-          }
-        }
-      }
+/*
+ * filter all channels of an interleaved history of `taps` frames with a row of the filter bank.
+ * pairs of taps are interleaved so that madd multiplies and sums two taps of each channel at once. Unlike fir_dot,
+ * this is measurably faster than the portable version, from about 1.2 times at 3 channels to 4 times at 8 or more.
+ */
+static INLINE void fir_dot_frames(const OPLL_RateConv *conv, const int16_t *hist, const int16_t *coef, int16_t *out) {
+#if EMU2413_SSE2
+  const int width = conv->width;
+  const __m128i shift = _mm_cvtsi32_si128(conv->amp_bits);
+  int16_t tmp[16];
+  int c = 0, k;
+#if EMU2413_AVX2
+  for (; c + 16 <= width; c += 16) {
+    __m256i lo = _mm256_setzero_si256(), hi = _mm256_setzero_si256();
+    for (k = 0; k < conv->taps; k += 2) {
+      const __m256i x0 = _mm256_loadu_si256((const __m256i *)(hist + k * width + c));
+      const __m256i x1 = _mm256_loadu_si256((const __m256i *)(hist + (k + 1) * width + c));
+      const __m256i cp = _mm256_set1_epi32((int32_t)((uint16_t)coef[k] | ((uint32_t)(uint16_t)coef[k + 1] << 16)));
+      lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(x0, x1), cp));
+      hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(x0, x1), cp));
     }
+    /* wrap to 16 bits like the scalar cast, then pack. packs works per 128-bit lane, which restores the order. */
+    lo = _mm256_srai_epi32(_mm256_slli_epi32(_mm256_sra_epi32(lo, shift), 16), 16);
+    hi = _mm256_srai_epi32(_mm256_slli_epi32(_mm256_sra_epi32(hi, shift), 16), 16);
+    _mm256_storeu_si256((__m256i *)tmp, _mm256_packs_epi32(lo, hi));
+    memcpy(out + c, tmp, sizeof(tmp[0]) * min(16, conv->ch - c));
   }
+#endif
+  for (; c < width; c += 8) {
+    __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+    for (k = 0; k < conv->taps; k += 2) {
+      const __m128i x0 = _mm_loadu_si128((const __m128i *)(hist + k * width + c));
+      const __m128i x1 = _mm_loadu_si128((const __m128i *)(hist + (k + 1) * width + c));
+      const __m128i cp = _mm_set1_epi32((int32_t)((uint16_t)coef[k] | ((uint32_t)(uint16_t)coef[k + 1] << 16)));
+      lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(x0, x1), cp));
+      hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(x0, x1), cp));
+    }
+    lo = _mm_srai_epi32(_mm_slli_epi32(_mm_sra_epi32(lo, shift), 16), 16);
+    hi = _mm_srai_epi32(_mm_slli_epi32(_mm_sra_epi32(hi, shift), 16), 16);
+    _mm_storeu_si128((__m128i *)tmp, _mm_packs_epi32(lo, hi));
+    memcpy(out + c, tmp, sizeof(tmp[0]) * min(8, conv->ch - c));
+  }
+#else
+  fir_dot_frames_c(conv, hist, coef, out);
+#endif
 }
 
-static void makeRksTable(void) {
-  int fnum8, block;
-  for (fnum8 = 0; fnum8 < 2; fnum8++)
-    for (block = 0; block < 8; block++) {
-      rks_table[(block << 1) | fnum8][1] = (block << 1) + fnum8;
-      rks_table[(block << 1) | fnum8][0] = block >> 1;
+/* the oldest sample is next to the latest one */
+#define RATECONV_HISTORY(conv, ch) ((conv)->buf + (conv)->hist_len * (ch) + (conv)->head[ch] + 1)
+#define RATECONV_FRAMES(conv) ((conv)->buf + ((conv)->head[0] + 1) * (conv)->width)
+
+/* get resampled data from this converter at f_out. */
+/* this function must be called f_out / f_inp times per one putData call. */
+/* the position advances when ch is 0, so channel 0 must be read first for each output sample. */
+int16_t OPLL_RateConv_getData(OPLL_RateConv *conv, int ch) {
+  if (ch == 0) {
+    advance_rate_conv(conv);
+  }
+  if (conv->width) {
+    const int16_t *hist = RATECONV_FRAMES(conv) + ch;
+    const int16_t *coef = conv->coef + conv->phase * conv->stride;
+    int32_t sum = 0;
+    int k;
+    for (k = 0; k < conv->taps; k++) {
+      sum += hist[k * conv->width] * coef[k];
     }
+    return sum >> conv->amp_bits;
+  }
+  return fir_dot(RATECONV_HISTORY(conv, ch), conv->coef + conv->phase * conv->stride, conv->stride) >> conv->amp_bits;
 }
 
-static void makeDefaultPatch(void) {
-  int i, j;
-  for (i = 0; i < OPLL_TONE_NUM; i++)
-    for (j = 0; j < 19; j++)
-      OPLL_getDefaultPatch(i, j, &default_patch[i][j * 2]);
+/* get resampled data of channel 0 and 1 at once. */
+static INLINE void rate_conv_get_stereo(OPLL_RateConv *conv, int16_t out[2]) {
+  int32_t sum[2];
+
+  advance_rate_conv(conv);
+  fir_dot2(RATECONV_HISTORY(conv, 0), RATECONV_HISTORY(conv, 1), conv->coef + conv->phase * conv->stride, conv->stride,
+           sum);
+  out[0] = sum[0] >> conv->amp_bits;
+  out[1] = sum[1] >> conv->amp_bits;
 }
 
-static uint8_t table_initialized = 0;
+/* group delay of the filter in output samples, when the input is put up to the time of the output. */
+double OPLL_RateConv_getDelay(OPLL_RateConv *conv) { return (double)conv->lookahead * conv->den / conv->num; }
 
-static void initializeTables(void) {
-  makeTllTable();
-  makeRksTable();
-  makeSinTable();
-  makeDefaultPatch();
-  table_initialized = 1;
+/* get one resampled sample of every channel. */
+void OPLL_RateConv_getFrame(OPLL_RateConv *conv, int16_t *out) {
+  if (conv->width) {
+    advance_rate_conv(conv);
+    fir_dot_frames(conv, RATECONV_FRAMES(conv), conv->coef + conv->phase * conv->stride, out);
+  } else if (conv->ch == 2) {
+    rate_conv_get_stereo(conv, out);
+  } else {
+    out[0] = OPLL_RateConv_getData(conv, 0);
+  }
+}
+
+void OPLL_RateConv_delete(OPLL_RateConv *conv) {
+  opll_free(conv->mem);
+  if (conv->coef_entry) {
+    release_coef_table(conv->coef_entry);
+  }
+  opll_free(conv);
 }
 
 /*********************************************************
@@ -431,7 +1119,7 @@ static void initializeTables(void) {
 
 #if OPLL_DEBUG
 static void _debug_print_patch(OPLL_SLOT *slot) {
-  OPLL_PATCH *p = slot->patch;
+  const OPLL_PATCH *p = slot->patch;
   printf("[slot#%d am:%d pm:%d eg:%d kr:%d ml:%d kl:%d tl:%d ws:%d fb:%d A:%d D:%d S:%d R:%d]\n", slot->number, //
          p->AM, p->PM, p->EG, p->KR, p->ML,                                                                     //
          p->KL, p->TL, p->WS, p->FB,                                                                            //
@@ -497,12 +1185,25 @@ enum SLOT_UPDATE_FLAG {
   UPDATE_TLL = 2,
   UPDATE_RKS = 4,
   UPDATE_EG = 8,
+  UPDATE_PG = 16,
   UPDATE_ALL = 255,
 };
 
+/* pg_inc_step that makes update_slots recalculate the phase increments of all slots */
+#define PG_INC_STALE 8
+
 static INLINE void request_update(OPLL_SLOT *slot, int flag) { slot->update_requests |= flag; }
 
-static void commit_slot_update(OPLL_SLOT *slot) {
+static INLINE uint32_t phase_increment(const OPLL_SLOT *slot, int8_t pm) {
+  return (((slot->fnum & 0x1ff) * 2 + pm) * ml_table[slot->patch->ML]) << slot->blk >> 2;
+}
+
+static INLINE void update_phase_increment(OPLL *opll, const OPLL_SLOT *slot) {
+  const int8_t pm = slot->patch->PM ? pm_table[(slot->fnum >> 6) & 7][(opll->pm_phase >> 10) & 7] : 0;
+  opll->pg_inc[slot->number] = phase_increment(slot, pm);
+}
+
+static void commit_slot_update(OPLL *opll, OPLL_SLOT *slot) {
 
 #if OPLL_DEBUG
   if (slot->last_eg_state != slot->eg_state) {
@@ -512,14 +1213,14 @@ static void commit_slot_update(OPLL_SLOT *slot) {
 #endif
 
   if (slot->update_requests & UPDATE_WS) {
-    slot->wave_table = wave_table_map[slot->patch->WS];
+    slot->wave_mask = wave_mask_map[slot->patch->WS];
   }
 
   if (slot->update_requests & UPDATE_TLL) {
     if ((slot->type & 1) == 0) {
-      slot->tll = tll_table[slot->blk_fnum >> 5][slot->patch->TL][slot->patch->KL];
+      opll->tll[slot->number] = kl_table[slot->blk_fnum >> 5][slot->patch->KL] + TL2EG(slot->patch->TL);
     } else {
-      slot->tll = tll_table[slot->blk_fnum >> 5][slot->volume][slot->patch->KL];
+      opll->tll[slot->number] = kl_table[slot->blk_fnum >> 5][slot->patch->KL] + TL2EG(slot->volume);
     }
   }
 
@@ -527,6 +1228,10 @@ static void commit_slot_update(OPLL_SLOT *slot) {
     slot->rks = rks_table[slot->blk_fnum >> 8][slot->patch->KR];
   }
 
+  if (slot->update_requests & UPDATE_PG) {
+    update_phase_increment(opll, slot);
+  }
+
   if (slot->update_requests & (UPDATE_RKS | UPDATE_EG)) {
     int p_rate = get_parameter_rate(slot);
 
@@ -549,26 +1254,27 @@ static void commit_slot_update(OPLL_SLOT *slot) {
   slot->update_requests = 0;
 }
 
-static void reset_slot(OPLL_SLOT *slot, int number) {
+static void reset_slot(OPLL *opll, int number) {
+  OPLL_SLOT *slot = &opll->slot[number];
   slot->number = number;
   slot->type = number % 2;
   slot->pg_keep = 0;
-  slot->wave_table = wave_table_map[0];
-  slot->pg_phase = 0;
-  slot->output[0] = 0;
-  slot->output[1] = 0;
+  slot->wave_mask = wave_mask_map[0];
+  opll->pg_phase[number] = 0;
+  opll->slot_out[number][0] = 0;
+  opll->slot_out[number][1] = 0;
   slot->eg_state = RELEASE;
   slot->eg_shift = 0;
   slot->rks = 0;
-  slot->tll = 0;
+  opll->tll[number] = 0;
   slot->key_flag = 0;
   slot->sus_flag = 0;
   slot->blk_fnum = 0;
   slot->blk = 0;
   slot->fnum = 0;
   slot->volume = 0;
-  slot->pg_out = 0;
-  slot->eg_out = EG_MUTE;
+  opll->pg_out[number] = 0;
+  opll->eg_out[number] = EG_MUTE;
   slot->patch = &null_patch;
 }
 
@@ -588,11 +1294,11 @@ static INLINE void slotOff(OPLL *opll, int i) {
   }
 }
 
-static INLINE void update_key_status(OPLL *opll) {
+/* the key of each slot from the registers */
+static INLINE uint32_t get_key_status(const OPLL *opll) {
   const uint8_t r14 = opll->reg[0x0e];
   const uint8_t rhythm_mode = BIT(r14, 5);
   uint32_t new_slot_key_status = 0;
-  uint32_t updated_status;
   int ch;
 
   for (ch = 0; ch < 9; ch++)
@@ -616,7 +1322,12 @@ static INLINE void update_key_status(OPLL *opll) {
       new_slot_key_status |= 1 << SLOT_CYM;
   }
 
-  updated_status = opll->slot_key_status ^ new_slot_key_status;
+  return new_slot_key_status;
+}
+
+static INLINE void update_key_status(OPLL *opll) {
+  const uint32_t new_slot_key_status = get_key_status(opll);
+  const uint32_t updated_status = opll->slot_key_status ^ new_slot_key_status;
 
   if (updated_status) {
     int i;
@@ -633,10 +1344,21 @@ static INLINE void update_key_status(OPLL *opll) {
   opll->slot_key_status = new_slot_key_status;
 }
 
+/* patch 0..37 of the chip: 0 and 1 are the user patch, the others are in the ROM set. */
+static INLINE const OPLL_PATCH *get_patch(const OPLL *opll, int32_t num) {
+  return num < 2 ? &opll->user_patch[num] : &opll->rom_patch[num];
+}
+
+static INLINE int32_t get_patch_index(const OPLL *opll, const OPLL_PATCH *patch) {
+  if (patch == &opll->user_patch[0] || patch == &opll->user_patch[1])
+    return (int32_t)(patch - opll->user_patch);
+  return (int32_t)(patch - opll->rom_patch);
+}
+
 static INLINE void set_patch(OPLL *opll, int32_t ch, int32_t num) {
   opll->patch_number[ch] = num;
-  MOD(opll, ch)->patch = &opll->patch[num * 2 + 0];
-  CAR(opll, ch)->patch = &opll->patch[num * 2 + 1];
+  MOD(opll, ch)->patch = get_patch(opll, num * 2 + 0);
+  CAR(opll, ch)->patch = get_patch(opll, num * 2 + 1);
   request_update(MOD(opll, ch), UPDATE_ALL);
   request_update(CAR(opll, ch), UPDATE_ALL);
 }
@@ -669,8 +1391,8 @@ static INLINE void set_fnumber(OPLL *opll, int ch, int fnum) {
   car->blk_fnum = (car->blk_fnum & 0xe00) | (fnum & 0x1ff);
   mod->fnum = fnum;
   mod->blk_fnum = (mod->blk_fnum & 0xe00) | (fnum & 0x1ff);
-  request_update(car, UPDATE_EG | UPDATE_RKS | UPDATE_TLL);
-  request_update(mod, UPDATE_EG | UPDATE_RKS | UPDATE_TLL);
+  request_update(car, UPDATE_EG | UPDATE_RKS | UPDATE_TLL | UPDATE_PG);
+  request_update(mod, UPDATE_EG | UPDATE_RKS | UPDATE_TLL | UPDATE_PG);
 }
 
 /* set block data (blk : 3bit ) */
@@ -681,8 +1403,8 @@ static INLINE void set_block(OPLL *opll, int ch, int blk) {
   car->blk_fnum = ((blk & 7) << 9) | (car->blk_fnum & 0x1ff);
   mod->blk = blk;
   mod->blk_fnum = ((blk & 7) << 9) | (mod->blk_fnum & 0x1ff);
-  request_update(car, UPDATE_EG | UPDATE_RKS | UPDATE_TLL);
-  request_update(mod, UPDATE_EG | UPDATE_RKS | UPDATE_TLL);
+  request_update(car, UPDATE_EG | UPDATE_RKS | UPDATE_TLL | UPDATE_PG);
+  request_update(mod, UPDATE_EG | UPDATE_RKS | UPDATE_TLL | UPDATE_PG);
 }
 
 static INLINE void update_rhythm_mode(OPLL *opll) {
@@ -739,9 +1461,39 @@ static void update_noise(OPLL *opll, int cycle) {
   }
 }
 
+/* product of a GF(2) matrix stored as columns and a vector */
+static uint32_t gf2_apply(const uint32_t *m, uint32_t x) {
+  uint32_t y = 0;
+  int j;
+  for (j = 0; x; j++, x >>= 1) {
+    if (x & 1)
+      y ^= m[j];
+  }
+  return y;
+}
+
+/* same as update_noise(opll, cycles) */
+static void jump_noise(OPLL *opll, uint64_t cycles) {
+  int k;
+  cycles %= NOISE_PERIOD;
+  for (k = 0; cycles; k++, cycles >>= 1) {
+    if (cycles & 1) {
+      opll->noise = gf2_apply(noise_jump_table[k], opll->noise);
+    }
+  }
+}
+
+/* applies the cycles of the samples where every slot was idle and the noise was not used */
+static INLINE void catch_up_noise(OPLL *opll) {
+  if (opll->noise_lag) {
+    jump_noise(opll, (uint64_t)opll->noise_lag * 18);
+    opll->noise_lag = 0;
+  }
+}
+
 static void update_short_noise(OPLL *opll) {
-  const uint32_t pg_hh = opll->slot[SLOT_HH].pg_out;
-  const uint32_t pg_cym = opll->slot[SLOT_CYM].pg_out;
+  const uint32_t pg_hh = opll->pg_out[SLOT_HH];
+  const uint32_t pg_cym = opll->pg_out[SLOT_CYM];
 
   const uint8_t h_bit2 = BIT(pg_hh, PG_BITS - 8);
   const uint8_t h_bit7 = BIT(pg_hh, PG_BITS - 3);
@@ -753,14 +1505,86 @@ static void update_short_noise(OPLL *opll) {
   opll->short_noise = (h_bit2 ^ h_bit7) | (h_bit3 ^ c_bit5) | (c_bit3 ^ c_bit5);
 }
 
-static INLINE void calc_phase(OPLL_SLOT *slot, int32_t pm_phase, uint8_t reset) {
-  const int8_t pm = slot->patch->PM ? pm_table[(slot->fnum >> 6) & 7][(pm_phase >> 10) & 7] : 0;
-  if (reset) {
-    slot->pg_phase = 0;
+/*
+ * Advance the phases of the slots in `active` by pg_inc. The others, including their pg_out, are left as they are.
+ * With SSE2, 8 slots are calculated at a time and the last 2 in the scalar loop.
+ */
+static INLINE void advance_phases(OPLL *opll, uint32_t active, uint8_t reset) {
+  int i = 0;
+#if EMU2413_SSE2
+  const __m128i bits = _mm_set_epi32(8, 4, 2, 1);
+  const __m128i width = _mm_set1_epi32(DP_WIDTH - 1);
+  const __m128i keep = reset ? _mm_setzero_si128() : _mm_set1_epi32(-1);
+  for (; i < 16; i += 8) {
+    __m128i *phase = (__m128i *)(opll->pg_phase + i);
+    __m128i *out = (__m128i *)(opll->pg_out + i);
+    const __m128i m0 = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(active >> i), bits), bits);
+    const __m128i m1 = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(active >> (i + 4)), bits), bits);
+    const __m128i p0 = _mm_loadu_si128(phase);
+    const __m128i p1 = _mm_loadu_si128(phase + 1);
+    const __m128i n0 = _mm_and_si128(
+        _mm_add_epi32(_mm_and_si128(p0, keep), _mm_loadu_si128((const __m128i *)(opll->pg_inc + i))), width);
+    const __m128i n1 = _mm_and_si128(
+        _mm_add_epi32(_mm_and_si128(p1, keep), _mm_loadu_si128((const __m128i *)(opll->pg_inc + i + 4))), width);
+    const __m128i m = _mm_packs_epi32(m0, m1);
+    const __m128i o = _mm_packs_epi32(_mm_srli_epi32(n0, DP_BASE_BITS), _mm_srli_epi32(n1, DP_BASE_BITS));
+    _mm_storeu_si128(phase, _mm_or_si128(_mm_and_si128(m0, n0), _mm_andnot_si128(m0, p0)));
+    _mm_storeu_si128(phase + 1, _mm_or_si128(_mm_and_si128(m1, n1), _mm_andnot_si128(m1, p1)));
+    _mm_storeu_si128(out, _mm_or_si128(_mm_and_si128(m, o), _mm_andnot_si128(m, _mm_loadu_si128(out))));
+  }
+#endif
+  for (; i < 18; i++) {
+    if ((active >> i) & 1) {
+      const uint32_t phase = reset ? 0 : opll->pg_phase[i];
+      opll->pg_phase[i] = (phase + opll->pg_inc[i]) & (DP_WIDTH - 1);
+      opll->pg_out[i] = opll->pg_phase[i] >> DP_BASE_BITS;
+    }
+  }
+}
+
+/*
+ * The phase of an idle slot advanced over the samples skipped since idle_pm_phase.
+ * pm_phase increases by one per sample while any slot is idle, and the PM depth depends only on bits 10-12 of it,
+ * so the skipped samples are counted for each of the 8 PM steps instead of being stepped one by one.
+ */
+static uint32_t caught_up_phase(OPLL *opll, int slot_num) {
+  const OPLL_SLOT *slot = &opll->slot[slot_num];
+  uint32_t n = opll->pm_phase - slot->idle_pm_phase;
+  uint32_t p = slot->idle_pm_phase + 1;
+  uint32_t count[8], total;
+  int i;
+
+  if (n == 0)
+    return opll->pg_phase[slot_num];
+
+  if (slot->patch->PM) {
+    for (i = 0; i < 8; i++) {
+      count[i] = (n >> 13) << 10;
+    }
+    n &= 8191;
+    while (n) {
+      const uint32_t len = min(n, 1024 - (p & 1023));
+      count[(p >> 10) & 7] += len;
+      p += len;
+      n -= len;
+    }
+    total = 0;
+    for (i = 0; i < 8; i++) {
+      total += count[i] * phase_increment(slot, pm_table[(slot->fnum >> 6) & 7][i]);
+    }
+  } else {
+    total = n * phase_increment(slot, 0);
+  }
+
+  return (opll->pg_phase[slot_num] + total) & (DP_WIDTH - 1);
+}
+
+static void catch_up_phase(OPLL *opll, int i) {
+  if (opll->pm_phase != opll->slot[i].idle_pm_phase) {
+    opll->pg_phase[i] = caught_up_phase(opll, i);
+    opll->pg_out[i] = opll->pg_phase[i] >> DP_BASE_BITS;
+    opll->slot[i].idle_pm_phase = opll->pm_phase;
   }
-  slot->pg_phase += (((slot->fnum & 0x1ff) * 2 + pm) * ml_table[slot->patch->ML]) << slot->blk >> 2;
-  slot->pg_phase &= (DP_WIDTH - 1);
-  slot->pg_out = slot->pg_phase >> DP_BASE_BITS;
 }
 
 static INLINE uint8_t lookup_attack_step(OPLL_SLOT *slot, uint32_t counter) {
@@ -805,31 +1629,37 @@ static INLINE uint8_t lookup_decay_step(OPLL_SLOT *slot, uint32_t counter) {
   }
 }
 
-static INLINE void start_envelope(OPLL_SLOT *slot) {
+static INLINE void start_envelope(OPLL_SLOT *slot, uint32_t *eg_out) {
   if (min(15, slot->patch->AR + (slot->rks >> 2)) == 15) {
     slot->eg_state = DECAY;
-    slot->eg_out = 0;
+    *eg_out = 0;
   } else {
     slot->eg_state = ATTACK;
   }
   request_update(slot, UPDATE_EG);
 }
 
-static INLINE void calc_envelope(OPLL_SLOT *slot, OPLL_SLOT *buddy, uint16_t eg_counter, uint8_t test) {
-
+/*
+ * The end of DAMP of a carrier resets the phase of its modulator too, which was already calculated for the sample.
+ * Its bit is returned, and the caller clears the phase after the phases of the sample are calculated.
+ */
+static INLINE uint32_t calc_envelope(OPLL *opll, int i, uint16_t eg_counter, uint8_t test) {
+  OPLL_SLOT *slot = &opll->slot[i];
+  uint32_t eg_out = opll->eg_out[i];
   uint32_t mask = (1 << slot->eg_shift) - 1;
+  uint32_t reset = 0;
   uint8_t s;
 
   if (slot->eg_state == ATTACK) {
-    if (0 < slot->eg_out && 0 < slot->eg_rate_h && (eg_counter & mask & ~3) == 0) {
+    if (0 < eg_out && 0 < slot->eg_rate_h && (eg_counter & mask & ~3) == 0) {
       s = lookup_attack_step(slot, eg_counter);
       if (0 < s) {
-        slot->eg_out = max(0, ((int)slot->eg_out - (slot->eg_out >> s) - 1));
+        eg_out = max(0, ((int)eg_out - (eg_out >> s) - 1));
       }
     }
   } else {
     if (slot->eg_rate_h > 0 && (eg_counter & mask) == 0) {
-      slot->eg_out = min(EG_MUTE, slot->eg_out + lookup_decay_step(slot, eg_counter));
+      eg_out = min(EG_MUTE, eg_out + lookup_decay_step(slot, eg_counter));
     }
   }
 
@@ -837,21 +1667,21 @@ static INLINE void calc_envelope(OPLL_SLOT *slot, OPLL_SLOT *buddy, uint16_t eg_
   case DAMP:
     // DAMP to ATTACK transition is occured when the envelope reaches EG_MAX (max attenuation but it's not mute).
     // Do not forget to check (eg_counter & mask) == 0 to synchronize it with the progress of the envelope.
-    if (slot->eg_out >= EG_MAX && (eg_counter & mask) == 0) {
-      start_envelope(slot);
+    if (eg_out >= EG_MAX && (eg_counter & mask) == 0) {
+      start_envelope(slot, &eg_out);
       if (slot->type & 1) {
         if (!slot->pg_keep) {
-          slot->pg_phase = 0;
+          opll->pg_phase[i] = 0;
         }
-        if (buddy && !buddy->pg_keep) {
-          buddy->pg_phase = 0;
+        if (slot->type == 1 && !opll->slot[i - 1].pg_keep) {
+          reset = 1 << (i - 1);
         }
       }
     }
     break;
 
   case ATTACK:
-    if (slot->eg_out == 0) {
+    if (eg_out == 0) {
       slot->eg_state = DECAY;
       request_update(slot, UPDATE_EG);
     }
@@ -860,7 +1690,7 @@ static INLINE void calc_envelope(OPLL_SLOT *slot, OPLL_SLOT *buddy, uint16_t eg_
   case DECAY:
     // DECAY to SUSTAIN transition must be checked at every cycle regardless of the conditions of the envelope rate and
     // counter. i.e. the transition is not synchronized with the progress of the envelope.
-    if ((slot->eg_out >> 3) == slot->patch->SL) {
+    if ((eg_out >> 3) == slot->patch->SL) {
       slot->eg_state = SUSTAIN;
       request_update(slot, UPDATE_EG);
     }
@@ -873,75 +1703,236 @@ static INLINE void calc_envelope(OPLL_SLOT *slot, OPLL_SLOT *buddy, uint16_t eg_
   }
 
   if (test) {
-    slot->eg_out = 0;
+    eg_out = 0;
   }
-}
-
-static void update_slots(OPLL *opll) {
-  int i;
-  opll->eg_counter++;
 
-  for (i = 0; i < 18; i++) {
-    OPLL_SLOT *slot = &opll->slot[i];
-    OPLL_SLOT *buddy = NULL;
-    if (slot->type == 0) {
-      buddy = &opll->slot[i + 1];
-    }
-    if (slot->type == 1) {
-      buddy = &opll->slot[i - 1];
-    }
-    if (slot->update_requests) {
-      commit_slot_update(slot);
-    }
-    calc_envelope(slot, buddy, opll->eg_counter, opll->test_flag & 1);
-    calc_phase(slot, opll->pm_phase, opll->test_flag & 4);
-  }
+  opll->eg_out[i] = eg_out;
+  return reset;
 }
 
-/* output: -4095...4095 */
-static INLINE int16_t lookup_exp_table(uint16_t i) {
-  /* from andete's expression */
-  int16_t t = (exp_table[(i & 0xff) ^ 0xff] + 1024);
+/*
+ * Update requests are left pending only when the parameter rate is 0, and they are committed again on every sample.
+ * That is harmless while nothing changes, so such a slot may be idle, or its envelope may sleep, as long as the commit
+ * would not change anything.
+ * The phase increment is not checked, since an idle slot does not use it and commits it again before it does.
+ */
+static int is_update_settled(OPLL *opll, int i) {
+  OPLL_SLOT *slot = &opll->slot[i];
+  const int req = slot->update_requests;
+  const int tl = (slot->type & 1) == 0 ? slot->patch->TL : slot->volume;
+
+  if (!req)
+    return 1;
+  if (!(req & (UPDATE_RKS | UPDATE_EG)) || get_parameter_rate(slot) != 0)
+    return 0;
+  if ((req & UPDATE_WS) && slot->wave_mask != wave_mask_map[slot->patch->WS])
+    return 0;
+  if ((req & UPDATE_TLL) && opll->tll[i] != kl_table[slot->blk_fnum >> 5][slot->patch->KL] + TL2EG(tl))
+    return 0;
+  if ((req & UPDATE_RKS) && slot->rks != rks_table[slot->blk_fnum >> 8][slot->patch->KR])
+    return 0;
+  return slot->eg_shift == 0 && slot->eg_rate_h == 0 && slot->eg_rate_l == 0;
+}
+
+/*
+ * The envelope of a slot sleeps until the eg_counter at which it may step next, when nothing else can change it: no
+ * transition is due, no update is pending and the test flag is off. Register and patch changes wake all of them.
+ * An envelope that does not step any more is calculated again when the 16-bit counter comes back to the same value,
+ * which changes nothing but keeps eg_wake meaningful.
+ */
+
+/* the first eg_counter after `counter` at which the envelope steps, or `counter` itself if it never does. */
+static uint16_t next_eg_step(const OPLL_SLOT *slot, uint16_t counter) {
+  const uint32_t attack = slot->eg_state == ATTACK;
+  const uint64_t pattern = eg_step_pattern[attack][slot->eg_rate_h][slot->eg_rate_l];
+  const uint32_t mask = (1 << slot->eg_shift) - 1;
+  /* number of counts at the start of each period of the shift that may step */
+  const uint32_t open = attack ? min(4, mask + 1) : 1;
+  uint16_t t = counter + 1;
+  int k;
+
+  if (pattern == 0)
+    return counter;
+
+  /* the pattern repeats every 16 periods */
+  for (k = 0; k <= 16; k++) {
+    if ((t & mask) >= open) {
+      t = (t | mask) + 1;
+    }
+    if ((pattern >> (((t >> slot->eg_shift) & 15) * 4)) & 15) {
+      return t;
+    }
+    t = (t | mask) + 1;
+  }
+  return counter;
+}
+
+/* called after calc_envelope. returns 1 and sets eg_wake if the envelope may sleep. */
+static INLINE int schedule_envelope(OPLL *opll, int i, uint16_t eg_counter) {
+  const OPLL_SLOT *slot = &opll->slot[i];
+  const uint32_t eg_out = opll->eg_out[i];
+
+  if (slot->update_requests && !is_update_settled(opll, i))
+    return 0;
+
+  switch (slot->eg_state) {
+  case ATTACK:
+    if (eg_out == 0)
+      return 0;
+    break;
+
+  case DECAY:
+    if ((eg_out >> 3) == slot->patch->SL)
+      return 0;
+    /* fall through */
+  case SUSTAIN:
+  case RELEASE:
+    if (eg_out == EG_MUTE) {
+      opll->eg_wake[i] = eg_counter;
+      return 1;
+    }
+    break;
+
+  case DAMP:
+    /* the end of DAMP is synchronized with the counter, like the steps */
+    if (eg_out >= EG_MAX) {
+      opll->eg_wake[i] = (eg_counter | ((1 << slot->eg_shift) - 1)) + 1;
+      return 1;
+    }
+    break;
+
+  default:
+    return 0;
+  }
+
+  opll->eg_wake[i] = next_eg_step(slot, eg_counter);
+  return 1;
+}
+
+static void update_slots(OPLL *opll) {
+  const uint32_t idle = opll->idle_mask;
+  const uint32_t skip = idle | opll->hold_mask;
+  const uint32_t defer = opll->defer_mask;
+  uint32_t sleep = opll->eg_sleep_mask;
+  uint32_t reset = 0;
+  uint16_t eg_counter;
+  int i;
+  eg_counter = (uint16_t)++opll->eg_counter;
+
+  for (i = 0; i < 18; i++) {
+    OPLL_SLOT *slot = &opll->slot[i];
+    if ((skip >> i) & 1) {
+      continue;
+    }
+    /* the carrier may reset the phase of the modulator on key-on. */
+    if (slot->type == 1 && slot->eg_state == DAMP && ((idle >> (i - 1)) & 1)) {
+      catch_up_phase(opll, i - 1);
+      opll->idle_mask &= ~(1 << (i - 1));
+    }
+    if (((sleep >> i) & 1) && opll->eg_wake[i] != eg_counter) {
+      continue;
+    }
+    if (slot->update_requests) {
+      commit_slot_update(opll, slot);
+    }
+    reset |= calc_envelope(opll, i, eg_counter, opll->test_flag & 1);
+    if (!(opll->test_flag & 1) && schedule_envelope(opll, i, eg_counter)) {
+      sleep |= 1 << i;
+    } else {
+      sleep &= ~(1 << i);
+    }
+  }
+  opll->eg_sleep_mask = sleep;
+
+  /* the PM of the LFO changes once in 1024 samples, and patch changes may affect any slot. */
+  if (opll->pg_inc_step != ((opll->pm_phase >> 10) & 7)) {
+    opll->pg_inc_step = (opll->pm_phase >> 10) & 7;
+    for (i = 0; i < 18; i++) {
+      update_phase_increment(opll, &opll->slot[i]);
+    }
+  }
+  advance_phases(opll, ~(skip | defer), opll->test_flag & 4);
+  for (i = 0; reset; i++, reset >>= 1) {
+    if (reset & 1) {
+      opll->pg_phase[i] = 0;
+    }
+  }
+}
+
+/*
+ * The second half of the wave is the first half with wave_mask ORed: the sign bit for the full sine, or the maximum
+ * attenuation for the half sine since no entry exceeds 0xfff.
+ */
+static INLINE uint16_t lookup_wave(const OPLL_SLOT *slot, uint32_t phase) {
+  const uint32_t half = 0 - ((phase >> (PG_BITS - 1)) & 1);
+  return sin_table[phase & (PG_WIDTH / 2 - 1)] | (slot->wave_mask & half);
+}
+
+/* output: -4095...4095 */
+static INLINE int16_t lookup_exp_table(uint16_t i) {
+  /* from andete's expression */
+  int16_t t = (exp_table[(i & 0xff) ^ 0xff] + 1024);
   int16_t res = t >> ((i & 0x7f00) >> 8);
   return ((i & 0x8000) ? ~res : res) << 1;
 }
 
-static INLINE int16_t to_linear(uint16_t h, OPLL_SLOT *slot, int16_t am) {
+static INLINE int16_t to_linear(const OPLL *opll, int i, uint16_t h, int16_t am) {
   uint16_t att;
-  if (slot->eg_out > EG_MAX)
+  if (opll->eg_out[i] > EG_MAX)
     return 0;
 
-  att = min(EG_MUTE, (slot->eg_out + slot->tll + am)) << 4;
+  att = min(EG_MUTE, (opll->eg_out[i] + opll->tll[i] + am)) << 4;
   return lookup_exp_table(h + att);
 }
 
+#define IS_IDLE(opll, i) (((opll)->idle_mask >> (i)) & 1)
+
+/* the output of an idle slot is kept as it is. */
 static INLINE int16_t calc_slot_car(OPLL *opll, int ch, int16_t fm) {
-  OPLL_SLOT *slot = CAR(opll, ch);
+  const int i = ch * 2 + 1;
+  OPLL_SLOT *slot = &opll->slot[i];
+  int16_t *output = opll->slot_out[i];
+
+  int16_t out;
+  uint8_t am;
+
+  if (IS_IDLE(opll, i))
+    return output[0];
 
-  uint8_t am = slot->patch->AM ? opll->lfo_am : 0;
+  am = slot->patch->AM ? opll->lfo_am : 0;
 
-  slot->output[1] = slot->output[0];
-  slot->output[0] = to_linear(slot->wave_table[(slot->pg_out + 2 * (fm >> 1)) & (PG_WIDTH - 1)], slot, am);
+  out = to_linear(opll, i, lookup_wave(slot, (opll->pg_out[i] + 2 * (fm >> 1)) & (PG_WIDTH - 1)), am);
+  output[1] = output[0];
+  output[0] = out;
 
-  return slot->output[0];
+  return out;
 }
 
 static INLINE int16_t calc_slot_mod(OPLL *opll, int ch) {
-  OPLL_SLOT *slot = MOD(opll, ch);
+  const int i = ch * 2;
+  OPLL_SLOT *slot = &opll->slot[i];
+  int16_t *output = opll->slot_out[i];
+
+  int16_t fm, out;
+  uint8_t am;
 
-  int16_t fm = slot->patch->FB > 0 ? (slot->output[1] + slot->output[0]) >> (9 - slot->patch->FB) : 0;
-  uint8_t am = slot->patch->AM ? opll->lfo_am : 0;
+  if (IS_IDLE(opll, i))
+    return output[0];
 
-  slot->output[1] = slot->output[0];
-  slot->output[0] = to_linear(slot->wave_table[(slot->pg_out + fm) & (PG_WIDTH - 1)], slot, am);
+  fm = slot->patch->FB > 0 ? (output[1] + output[0]) >> (9 - slot->patch->FB) : 0;
+  am = slot->patch->AM ? opll->lfo_am : 0;
 
-  return slot->output[0];
+  out = to_linear(opll, i, lookup_wave(slot, (opll->pg_out[i] + fm) & (PG_WIDTH - 1)), am);
+  output[1] = output[0];
+  output[0] = out;
+
+  return out;
 }
 
 static INLINE int16_t calc_slot_tom(OPLL *opll) {
   OPLL_SLOT *slot = MOD(opll, 8);
 
-  return to_linear(slot->wave_table[slot->pg_out], slot, 0);
+  return to_linear(opll, SLOT_TOM, lookup_wave(slot, opll->pg_out[SLOT_TOM]), 0);
 }
 
 /* Specify phase offset directly based on 10-bit (1024-length) sine table */
@@ -952,12 +1943,12 @@ static INLINE int16_t calc_slot_snare(OPLL *opll) {
 
   uint32_t phase;
 
-  if (BIT(slot->pg_out, PG_BITS - 2))
+  if (BIT(opll->pg_out[SLOT_SD], PG_BITS - 2))
     phase = (opll->noise & 1) ? _PD(0x300) : _PD(0x200);
   else
     phase = (opll->noise & 1) ? _PD(0x0) : _PD(0x100);
 
-  return to_linear(slot->wave_table[phase], slot, 0);
+  return to_linear(opll, SLOT_SD, lookup_wave(slot, phase), 0);
 }
 
 static INLINE int16_t calc_slot_cym(OPLL *opll) {
@@ -965,7 +1956,7 @@ static INLINE int16_t calc_slot_cym(OPLL *opll) {
 
   uint32_t phase = opll->short_noise ? _PD(0x300) : _PD(0x100);
 
-  return to_linear(slot->wave_table[phase], slot, 0);
+  return to_linear(opll, SLOT_CYM, lookup_wave(slot, phase), 0);
 }
 
 static INLINE int16_t calc_slot_hat(OPLL *opll) {
@@ -978,7 +1969,190 @@ static INLINE int16_t calc_slot_hat(OPLL *opll) {
   else
     phase = (opll->noise & 1) ? _PD(0x34) : _PD(0xd0);
 
-  return to_linear(slot->wave_table[phase], slot, 0);
+  return to_linear(opll, SLOT_HH, lookup_wave(slot, phase), 0);
+}
+
+/***********************************************************
+
+                   Idle Slots
+
+***********************************************************/
+/*
+ * A slot becomes idle when its envelope can no longer change and its output cannot be heard:
+ * - the channel is masked, so the output is not calculated at all, or
+ * - the envelope is muted and the output history is already 0, or
+ * - it is a modulator without feedback whose carrier is idle. Its output history is rebuilt when it wakes up.
+ * Idle slots are skipped entirely. They wake up before any register or patch change, with the phase caught up, so
+ * the result is identical to updating them on every sample.
+ */
+
+/* samples between scans for slots that can be idled (power of 2) */
+#define IDLE_SCAN_INTERVAL 8
+#define ALL_SLOTS ((1 << 18) - 1)
+
+static INLINE int is_eg_stationary(OPLL *opll, int i) {
+  const OPLL_SLOT *slot = &opll->slot[i];
+  switch (slot->eg_state) {
+  case ATTACK:
+    return slot->eg_rate_h == 0 && opll->eg_out[i] != 0;
+  case DECAY:
+    if ((opll->eg_out[i] >> 3) == slot->patch->SL)
+      return 0;
+    /* fall through */
+  case SUSTAIN:
+  case RELEASE:
+    return slot->eg_rate_h == 0 || opll->eg_out[i] == EG_MUTE;
+  default:
+    return 0;
+  }
+}
+
+static INLINE uint32_t slot_mask_bit(OPLL *opll, int i) {
+  static const uint32_t rhythm_mask[6] = {OPLL_MASK_BD, OPLL_MASK_BD,  OPLL_MASK_HH,
+                                          OPLL_MASK_SD, OPLL_MASK_TOM, OPLL_MASK_CYM};
+  if (opll->rhythm_mode && i >= SLOT_BD1) {
+    return rhythm_mask[i - SLOT_BD1];
+  }
+  return OPLL_MASK_CH(i >> 1);
+}
+
+/* called after the output of a sample is calculated. carriers are checked before their modulators. */
+static void update_idle_slots(OPLL *opll) {
+  uint32_t idle = opll->idle_mask;
+  int i;
+
+  if (opll->test_flag)
+    return;
+
+  for (i = 17; i >= 0; i--) {
+    OPLL_SLOT *slot = &opll->slot[i];
+    if (((idle >> i) & 1) || !is_eg_stationary(opll, i))
+      continue;
+    if (opll->mask & slot_mask_bit(opll, i)) {
+      /* output is not calculated */
+    } else if ((opll->stale_mask >> i) & 1) {
+      /* the output history is not known */
+      continue;
+    } else if (opll->eg_out[i] > EG_MAX && (slot->type == 3 || (opll->slot_out[i][0] | opll->slot_out[i][1]) == 0)) {
+      /* output stays 0. single slots of the rhythm do not use the history. */
+    } else if (slot->type == 0 && slot->patch->FB == 0 && ((idle >> (i + 1)) & 1)) {
+      opll->recon_mask |= 1 << i;
+    } else {
+      continue;
+    }
+    if (!is_update_settled(opll, i)) {
+      opll->recon_mask &= ~(1 << i);
+      continue;
+    }
+    idle |= 1 << i;
+    if (!((opll->defer_mask >> i) & 1)) {
+      /* a deferred phase is caught up from where it was deferred */
+      slot->idle_pm_phase = opll->pm_phase;
+    }
+  }
+
+  /* the noise of HH and CYM depends on the phase of both slots */
+  if (opll->rhythm_mode && (((idle >> SLOT_HH) ^ (idle >> SLOT_CYM)) & 1)) {
+    idle &= ~((1 << SLOT_HH) | (1 << SLOT_CYM));
+  }
+
+  opll->idle_mask = idle;
+  opll->defer_mask &= ~idle;
+  opll->hold_mask &= ~idle;
+  opll->eg_sleep_mask &= ~idle;
+}
+
+/*
+ * output history of a modulator without feedback over the last n samples, from the phase caught up to the current
+ * sample and the constant EG.
+ */
+static void rebuild_output(OPLL *opll, int i, uint32_t n, uint32_t phase, int16_t output[2]) {
+  const OPLL_SLOT *slot = &opll->slot[i];
+  const int8_t pm = slot->patch->PM ? pm_table[(slot->fnum >> 6) & 7][(opll->pm_phase >> 10) & 7] : 0;
+  const uint32_t prev_phase = (phase - phase_increment(slot, pm)) & (DP_WIDTH - 1);
+  const uint8_t am = slot->patch->AM ? opll->lfo_am : 0;
+  const uint8_t prev_am = slot->patch->AM ? am_table[((opll->am_phase - 1) >> 6) % sizeof(am_table)] : 0;
+
+  if (n >= 2) {
+    output[1] = to_linear(opll, i, lookup_wave(slot, prev_phase >> DP_BASE_BITS), prev_am);
+  } else {
+    output[1] = output[0];
+  }
+  output[0] = to_linear(opll, i, lookup_wave(slot, phase >> DP_BASE_BITS), am);
+}
+
+/* the slots in mask are calculated again from the next sample. slots are woken by channel, both slots together. */
+static void wake_slots(OPLL *opll, uint32_t mask) {
+  const uint32_t idle = opll->idle_mask & mask;
+  int i;
+  for (i = 0; i < 18; i++) {
+    if ((idle >> i) & 1) {
+      const uint32_t n = opll->pm_phase - opll->slot[i].idle_pm_phase;
+      catch_up_phase(opll, i);
+      if (((opll->recon_mask >> i) & 1) && n > 0) {
+        rebuild_output(opll, i, n, opll->pg_phase[i], opll->slot_out[i]);
+      }
+    }
+  }
+  opll->idle_mask &= ~mask;
+  opll->recon_mask &= ~mask;
+  opll->eg_sleep_mask &= ~mask;
+}
+
+#define RHYTHM_SLOTS (((1 << 6) - 1) << SLOT_BD1)
+
+/* slots whose state a write to the register may change, after the register is stored. reg is not a mirror register. */
+static uint32_t get_write_slots(OPLL *opll, uint32_t reg) {
+  uint32_t mask = 0, keys;
+  int ch;
+
+  if (reg < 0x08) {
+    /* the user patch */
+    for (ch = 0; ch < 9; ch++) {
+      if (opll->patch_number[ch] == 0)
+        mask |= 3 << (ch * 2);
+    }
+    return mask;
+  }
+  if (reg == 0x0e)
+    return opll->chip_type == 1 ? 0 : RHYTHM_SLOTS;
+  if (reg == 0x0f)
+    return ALL_SLOTS;
+  if (reg < 0x10 || (reg & 0x0f) >= 9)
+    return 0;
+
+  ch = reg & 0x0f;
+  mask = 3 << (ch * 2);
+  if ((reg & 0xf0) == 0x20) {
+    /* a key-on write updates the keys of every slot, and the rhythm keys may follow r#14 or not */
+    keys = opll->slot_key_status ^ get_key_status(opll);
+    mask |= keys | ((keys & 0x15555) << 1) | ((keys & 0x2aaaa) >> 1);
+  }
+  /* HH and CYM share their phases */
+  if (opll->rhythm_mode && (mask & RHYTHM_SLOTS))
+    mask |= RHYTHM_SLOTS;
+  return mask;
+}
+
+/* timestamped register write */
+struct __OPLL_WRITE {
+  uint32_t time; /* internal sample count, or output sample count if WRITE_AT_SAMPLE is set */
+  uint8_t flags;
+  uint8_t reg;
+  uint8_t data;
+};
+
+#define WRITE_AT_SAMPLE 1
+
+static void process_write_queue(OPLL *opll) {
+  while (opll->wq_head != opll->wq_tail) {
+    struct __OPLL_WRITE *w = &opll->write_queue[opll->wq_head];
+    const uint32_t now = (w->flags & WRITE_AT_SAMPLE) ? opll->out_count : opll->inp_count;
+    if ((int32_t)(w->time - now) > 0)
+      break;
+    OPLL_writeReg(opll, w->reg, w->data);
+    opll->wq_head = (opll->wq_head + 1) % OPLL_WRITE_QUEUE_SIZE;
+  }
 }
 
 #define _MO(x) (-(x) >> 1)
@@ -988,7 +2162,22 @@ static void update_output(OPLL *opll) {
   int16_t *out;
   int i;
 
+  if (opll->wq_head != opll->wq_tail) {
+    process_write_queue(opll);
+  }
+
   update_ampm(opll);
+
+  if (opll->idle_mask == ALL_SLOTS) {
+    /* nothing to calculate: only the global counters advance, and every output is kept. */
+    opll->eg_counter++;
+    if (++opll->noise_lag == NOISE_PERIOD)
+      opll->noise_lag = 0;
+    opll->inp_count++;
+    return;
+  }
+  catch_up_noise(opll);
+
   update_short_noise(opll);
   update_slots(opll);
 
@@ -1019,10 +2208,10 @@ static void update_output(OPLL *opll) {
       out[7] = _MO(calc_slot_car(opll, 7, calc_slot_mod(opll, 7)));
     }
   } else {
-    if (!(opll->mask & OPLL_MASK_HH)) {
+    if (!(opll->mask & OPLL_MASK_HH) && !IS_IDLE(opll, SLOT_HH)) {
       out[10] = _RO(calc_slot_hat(opll));
     }
-    if (!(opll->mask & OPLL_MASK_SD)) {
+    if (!(opll->mask & OPLL_MASK_SD) && !IS_IDLE(opll, SLOT_SD)) {
       out[11] = _RO(calc_slot_snare(opll));
     }
   }
@@ -1034,32 +2223,103 @@ static void update_output(OPLL *opll) {
       out[8] = _MO(calc_slot_car(opll, 8, calc_slot_mod(opll, 8)));
     }
   } else {
-    if (!(opll->mask & OPLL_MASK_TOM)) {
+    if (!(opll->mask & OPLL_MASK_TOM) && !IS_IDLE(opll, SLOT_TOM)) {
       out[12] = _RO(calc_slot_tom(opll));
     }
-    if (!(opll->mask & OPLL_MASK_CYM)) {
+    if (!(opll->mask & OPLL_MASK_CYM) && !IS_IDLE(opll, SLOT_CYM)) {
       out[13] = _RO(calc_slot_cym(opll));
     }
   }
   update_noise(opll, 2);
+
+  /* the scan is exact whenever it runs; running it every sample only costs time on busy chips. */
+  if ((opll->inp_count & (IDLE_SCAN_INTERVAL - 1)) == 0)
+    update_idle_slots(opll);
+
+  opll->inp_count++;
 }
 
-INLINE static void mix_output(OPLL *opll) {
+/* gains of the mixer are fixed point numbers of MIX_GAIN_BITS fraction bits. */
+#define MIX_GAIN_BITS 14
+
+static int16_t to_mix_gain(float gain) {
+  const double g = floor(gain * (1 << MIX_GAIN_BITS) + 0.5);
+  return (int16_t)(g < -32768 ? -32768 : (g > 32767 ? 32767 : g));
+}
+
+/*
+ * The integer mix is bit-exact with the float mix only if every product is an integer that the float mix does not
+ * truncate, that is for gains of -2, -1, 0 and 1.
+ */
+INLINE static int is_integer_gain(float gain) { return gain == 0 || gain == 1 || gain == -1 || gain == -2; }
+
+/* buses 0 and 1 of the channel, from pan and pan_fine. ch 14 and 15 are not mixed. */
+static void update_pan_gain(OPLL *opll, uint32_t ch) {
+  float left, right;
+  if (ch >= 14)
+    return;
+  left = (opll->pan[ch] & 2) ? opll->pan_fine[ch][0] : 0;
+  right = (opll->pan[ch] & 1) ? opll->pan_fine[ch][1] : 0;
+  opll->mix_gain[0][ch] = to_mix_gain(left);
+  opll->mix_gain[1][ch] = to_mix_gain(right);
+  if (is_integer_gain(left) && is_integer_gain(right)) {
+    opll->float_pan_mask &= ~(1 << ch);
+  } else {
+    opll->float_pan_mask |= 1 << ch;
+  }
+}
+
+INLINE static int16_t mix_mono(OPLL *opll) {
   int16_t out = 0;
   int i;
   for (i = 0; i < 14; i++) {
     out += opll->ch_out[i];
   }
-  if (opll->conv) {
-    OPLL_RateConv_putData(opll->conv, 0, out);
-  } else {
-    opll->mix_out[0] = out;
+  return out;
+}
+
+/*
+ * out[b] = sum of ch_out[i] * mix_gain[b][i] for every bus b, as a matrix product.
+ * With four buses, the partial sums of all buses are transposed and added in one register.
+ */
+INLINE static void mix_buses(OPLL *opll, int16_t out[OPLL_BUS_MAX]) {
+#if EMU2413_SSE2 && OPLL_BUS_MAX == 4
+  const __m128i x0 = _mm_loadu_si128((const __m128i *)opll->ch_out);
+  const __m128i x1 = _mm_loadu_si128((const __m128i *)(opll->ch_out + 8));
+  __m128i acc[OPLL_BUS_MAX], t0, t1;
+  int b;
+  for (b = 0; b < OPLL_BUS_MAX; b++) {
+    acc[b] = _mm_add_epi32(_mm_madd_epi16(x0, _mm_loadu_si128((const __m128i *)opll->mix_gain[b])),
+                           _mm_madd_epi16(x1, _mm_loadu_si128((const __m128i *)(opll->mix_gain[b] + 8))));
+  }
+  t0 = _mm_add_epi32(_mm_unpacklo_epi32(acc[0], acc[1]), _mm_unpackhi_epi32(acc[0], acc[1]));
+  t1 = _mm_add_epi32(_mm_unpacklo_epi32(acc[2], acc[3]), _mm_unpackhi_epi32(acc[2], acc[3]));
+  t0 = _mm_add_epi32(_mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1));
+  /* wrap to 16 bits like the scalar cast, then pack */
+  t0 = _mm_srai_epi32(_mm_slli_epi32(_mm_srai_epi32(t0, MIX_GAIN_BITS), 16), 16);
+  _mm_storel_epi64((__m128i *)out, _mm_packs_epi32(t0, t0));
+#else
+  int b, i;
+  for (b = 0; b < OPLL_BUS_MAX; b++) {
+    int32_t sum = 0;
+    for (i = 0; i < 16; i++) {
+      sum += opll->ch_out[i] * opll->mix_gain[b][i];
+    }
+    out[b] = sum >> MIX_GAIN_BITS;
   }
+#endif
 }
 
-INLINE static void mix_output_stereo(OPLL *opll) {
-  int16_t *out = opll->mix_out;
+/* the integer mix is used unless a channel has a gain that it would round differently */
+INLINE static void mix_stereo(OPLL *opll, int16_t out[2]) {
+  int16_t bus[OPLL_BUS_MAX];
   int i;
+  if (!opll->float_pan_mask) {
+    mix_buses(opll, bus);
+    out[0] = bus[0];
+    out[1] = bus[1];
+    return;
+  }
   out[0] = out[1] = 0;
   for (i = 0; i < 14; i++) {
     if (opll->pan[i] & 2)
@@ -1067,98 +2327,511 @@ INLINE static void mix_output_stereo(OPLL *opll) {
     if (opll->pan[i] & 1)
       out[1] += (int16_t)(opll->ch_out[i] * opll->pan_fine[i][1]);
   }
-  if (opll->conv) {
-    OPLL_RateConv_putData(opll->conv, 0, out[0]);
-    OPLL_RateConv_putData(opll->conv, 1, out[1]);
-  }
 }
 
 /***********************************************************
 
-                   External Interfaces
+                   Additional Outputs
 
 ***********************************************************/
+/*
+ * Each additional output resamples the same internal samples to its own rate and stores the result in a FIFO.
+ * The cadence is the same integer scheme as the main output, driven by input instead of output: every internal
+ * sample advances out_time by inp_step, and an output frame is produced each time out_time reaches out_step.
+ * An output with the same rate and settings as the main output produces exactly the same samples.
+ */
+struct __OPLL_OUTPUT {
+  uint32_t rate;
+  int ch;            /* number of channels of a frame */
+  uint32_t inp_step; /* cadence, scaled by 72 */
+  uint32_t out_step;
+  uint32_t out_time;
+  OPLL_RateConv *conv; /* NULL if the rate is clock / 72 */
+  int16_t *fifo;
+  uint32_t capacity; /* size of fifo in frames */
+  uint32_t read;     /* read position in frames */
+  uint32_t count;    /* number of frames in fifo */
+};
 
-OPLL *OPLL_new(uint32_t clk, uint32_t rate) {
-  OPLL *opll;
-  int i;
-
-  if (!table_initialized) {
-    initializeTables();
+/* the conversion is skipped if the rate is close enough to clock / 72. */
+static INLINE int needs_rate_conv(uint32_t clk, uint32_t rate) { return clk / 72 != rate && (clk + 36) / 72 != rate; }
+
+/* the converter of the output is reset in place, since the rate of an output does not change. */
+static void reset_output(OPLL *opll, struct __OPLL_OUTPUT *o) {
+  o->out_time = 0;
+  o->out_step = opll->clk;
+  o->inp_step = o->rate * 72;
+  o->read = o->count = 0;
+  if (o->conv) {
+    OPLL_RateConv_reset(o->conv);
   }
+}
 
-  opll = (OPLL *)calloc(1, sizeof(OPLL));
-  if (opll == NULL)
-    return NULL;
-
-  for (i = 0; i < 19 * 2; i++)
-    memcpy(&opll->patch[i], &null_patch, sizeof(OPLL_PATCH));
+/* (re)create the converter of the output with the current settings. */
+static void init_output_conv(OPLL *opll, struct __OPLL_OUTPUT *o) {
+  if (o->conv) {
+    OPLL_RateConv_delete(o->conv);
+    o->conv = NULL;
+  }
+  if (needs_rate_conv(opll->clk, o->rate)) {
+    o->conv = rate_conv_new(opll->clk, o->rate * 72, o->ch, &opll->conv_config);
+  }
+  reset_output(opll, o);
+}
 
-  opll->clk = clk;
-  opll->rate = rate;
-  opll->mask = 0;
-  opll->conv = NULL;
-  opll->mix_out[0] = 0;
-  opll->mix_out[1] = 0;
+static void feed_output(struct __OPLL_OUTPUT *o, const int16_t *in) {
+  int16_t tmp[16];
+  int16_t *dst;
 
-  OPLL_reset(opll);
-  OPLL_setChipType(opll, 0);
-  OPLL_resetPatch(opll, 0);
-  return opll;
-}
+  if (o->conv) {
+    OPLL_RateConv_putFrame(o->conv, in);
+  }
 
-void OPLL_delete(OPLL *opll) {
-  if (opll->conv) {
-    OPLL_RateConv_delete(opll->conv);
-    opll->conv = NULL;
+  o->out_time += o->inp_step;
+  while (o->out_time >= o->out_step) {
+    o->out_time -= o->out_step;
+    if (o->count < o->capacity) {
+      uint32_t pos = o->read + o->count++;
+      if (pos >= o->capacity)
+        pos -= o->capacity;
+      dst = o->fifo + pos * o->ch;
+    } else {
+      /* the FIFO is full: the frame is dropped, but the converter still has to advance. */
+      dst = NULL;
+    }
+    if (o->conv == NULL) {
+      if (dst)
+        memcpy(dst, in, sizeof(in[0]) * o->ch);
+    } else {
+      OPLL_RateConv_getFrame(o->conv, dst ? dst : tmp);
+    }
   }
-  free(opll);
 }
 
-static void reset_rate_conversion_params(OPLL *opll) {
-  const double f_out = opll->rate;
-  const double f_inp = opll->clk / 72.0;
+/* mono and stereo are the mix of the main output if it has been calculated, otherwise NULL. */
+static void feed_outputs(OPLL *opll, const int16_t *mono, const int16_t *stereo) {
+  int16_t mono_buf, stereo_buf[2], buses_buf[OPLL_BUS_MAX];
+  const int16_t *buses = NULL;
+  int i;
 
-  opll->out_time = 0;
-  opll->out_step = f_inp;
-  opll->inp_step = f_out;
+  for (i = 0; i < OPLL_OUTPUT_MAX; i++) {
+    struct __OPLL_OUTPUT *o = opll->output[i];
+    if (o == NULL)
+      continue;
+    if (o->ch == OPLL_OUTPUT_STEMS) {
+      feed_output(o, opll->ch_out);
+    } else if (o->ch == OPLL_OUTPUT_BUSES) {
+      if (buses == NULL) {
+        mix_buses(opll, buses_buf);
+        if (opll->float_pan_mask)
+          mix_stereo(opll, buses_buf);
+        buses = buses_buf;
+      }
+      feed_output(o, buses);
+    } else if (o->ch == 1) {
+      if (mono == NULL) {
+        mono_buf = mix_mono(opll);
+        mono = &mono_buf;
+      }
+      feed_output(o, mono);
+    } else {
+      if (stereo == NULL) {
+        mix_stereo(opll, stereo_buf);
+        stereo = stereo_buf;
+      }
+      feed_output(o, stereo);
+    }
+  }
+}
 
+INLINE static void mix_output(OPLL *opll) {
+  int16_t out = mix_mono(opll);
   if (opll->conv) {
-    OPLL_RateConv_delete(opll->conv);
-    opll->conv = NULL;
+    OPLL_RateConv_putData(opll->conv, 0, out);
+  } else {
+    opll->mix_out[0] = out;
   }
-
-  if (floor(f_inp) != f_out && floor(f_inp + 0.5) != f_out) {
-    opll->conv = OPLL_RateConv_new(f_inp, f_out, 2);
+  if (opll->num_outputs) {
+    feed_outputs(opll, &out, NULL);
   }
+}
 
+INLINE static void mix_output_stereo(OPLL *opll) {
+  int16_t *out = opll->mix_out;
+  mix_stereo(opll, out);
   if (opll->conv) {
-    OPLL_RateConv_reset(opll->conv);
+    OPLL_RateConv_putData(opll->conv, 0, out[0]);
+    OPLL_RateConv_putData(opll->conv, 1, out[1]);
+  }
+  if (opll->num_outputs) {
+    feed_outputs(opll, NULL, out);
   }
 }
 
-void OPLL_reset(OPLL *opll) {
-  int i;
+/***********************************************************
 
-  if (!opll)
-    return;
+                   Fast Forward
 
-  opll->adr = 0;
+***********************************************************/
+/*
+ * OPLL_advance updates the slots, the LFO and the noise exactly as update_output does, but skips the operator
+ * outputs, the mixer and the rate converters where nothing depends on them:
+ * - modulators with feedback are still calculated, since their output is part of their next input.
+ * - other slots keep their output history only while they are muted and the output is 0. The others are marked in
+ *   stale_mask, so that they are not made idle by a history that is not known.
+ * - the phase of a slot whose output is not calculated is deferred (defer_mask) and caught up analytically like an
+ *   idle slot, unless it can be reset by the end of DAMP. If its envelope is stationary, it is skipped entirely
+ *   (hold_mask), whether it is heard or not.
+ * - the two internal samples before a queued write is applied, and the last ones that fill the converter history,
+ *   are calculated in full. After them every output, history and converter is the same as after rendering.
+ * The noise LFSR is linear over GF(2), so the skipped cycles are applied at once as a power of its transition matrix.
+ * The converters skip their phase and cadence in closed form.
+ */
 
-  opll->pm_phase = 0;
-  opll->am_phase = 0;
+/* the output of the slot is skipped. stale[0] and stale[1] are the slots whose output[0] and output[1] are not exact. */
+static INLINE void skip_slot_output(OPLL *opll, int i, uint32_t stale[2]) {
+  int16_t *output = opll->slot_out[i];
+  const uint32_t bit = 1 << i;
 
-  opll->noise = 0x1;
-  opll->mask = 0;
+  if (IS_IDLE(opll, i))
+    return;
+
+  output[1] = output[0];
+  stale[1] = (stale[1] & ~bit) | (stale[0] & bit);
+  if (opll->eg_out[i] > EG_MAX) {
+    output[0] = 0;
+    stale[0] &= ~bit;
+  } else {
+    stale[0] |= bit;
+  }
+}
+
+/* returns whether the output of the carrier is exact, so that the channel output can be updated with it. */
+static INLINE int skip_channel_output(OPLL *opll, int ch, uint32_t stale[2]) {
+  if (MOD(opll, ch)->patch->FB > 0) {
+    calc_slot_mod(opll, ch);
+  } else {
+    skip_slot_output(opll, ch * 2, stale);
+  }
+  skip_slot_output(opll, ch * 2 + 1, stale);
+  return !((stale[0] >> (ch * 2 + 1)) & 1);
+}
+
+/* a single slot of the rhythm has no history, but its output is kept in ch_out while it is idle. */
+static INLINE void skip_rhythm_output(OPLL *opll, int i, int16_t *out, uint32_t stale[2]) {
+  const uint32_t bit = 1 << i;
+
+  if (IS_IDLE(opll, i))
+    return;
+
+  if (opll->eg_out[i] > EG_MAX) {
+    *out = 0;
+    stale[0] &= ~bit;
+    stale[1] &= ~bit;
+  } else {
+    stale[0] |= bit;
+  }
+}
+
+/* choose the slots whose phase is deferred. called between internal samples. */
+static void update_defer_mask(OPLL *opll) {
+  uint32_t defer = 0, hold = 0, changed;
+  int i;
+
+  if (opll->test_flag == 0) {
+    for (i = 0; i < 18; i++) {
+      /* the end of DAMP resets the phase of both slots of the pair */
+      if (opll->slot[i].eg_state != DAMP && opll->slot[i ^ 1].eg_state != DAMP) {
+        defer |= 1 << i;
+      }
+    }
+    for (i = 0; i < 9; i++) {
+      const uint32_t mask = (opll->rhythm_mode && i == 6) ? OPLL_MASK_BD : OPLL_MASK_CH(i);
+      if (opll->rhythm_mode && i >= 7)
+        break;
+      if (!(opll->mask & mask) && MOD(opll, i)->patch->FB > 0) {
+        defer &= ~(1 << (i * 2));
+      }
+    }
+    defer &= ~opll->idle_mask;
+    for (i = 0; i < 18; i++) {
+      if (((defer >> i) & 1) && is_eg_stationary(opll, i) && is_update_settled(opll, i)) {
+        hold |= 1 << i;
+      }
+    }
+  }
+
+  changed = defer ^ opll->defer_mask;
+  for (i = 0; i < 18; i++) {
+    if ((changed >> i) & 1) {
+      if ((defer >> i) & 1) {
+        opll->slot[i].idle_pm_phase = opll->pm_phase;
+      } else {
+        catch_up_phase(opll, i);
+      }
+    }
+  }
+  opll->defer_mask = defer;
+  opll->hold_mask = hold;
+  opll->eg_sleep_mask &= ~hold;
+}
+
+/* update_output without the output. the noise is not updated; the caller applies 18 cycles per call later. */
+static void update_state(OPLL *opll, uint32_t stale[2]) {
+  int16_t *out = opll->ch_out;
+  int i;
+
+  update_ampm(opll);
+
+  if (opll->idle_mask == ALL_SLOTS) {
+    opll->eg_counter++;
+    opll->inp_count++;
+    return;
+  }
+
+  update_slots(opll);
+
+  for (i = 0; i < 9; i++) {
+    if (opll->rhythm_mode && i >= 6)
+      break;
+    if (!(opll->mask & OPLL_MASK_CH(i)) && skip_channel_output(opll, i, stale)) {
+      out[i] = _MO(opll->slot_out[i * 2 + 1][0]);
+    }
+  }
+  if (opll->rhythm_mode) {
+    if (!(opll->mask & OPLL_MASK_BD) && skip_channel_output(opll, 6, stale)) {
+      out[9] = _RO(opll->slot_out[SLOT_BD2][0]);
+    }
+    if (!(opll->mask & OPLL_MASK_HH)) {
+      skip_rhythm_output(opll, SLOT_HH, &out[10], stale);
+    }
+    if (!(opll->mask & OPLL_MASK_SD)) {
+      skip_rhythm_output(opll, SLOT_SD, &out[11], stale);
+    }
+    if (!(opll->mask & OPLL_MASK_TOM)) {
+      skip_rhythm_output(opll, SLOT_TOM, &out[12], stale);
+    }
+    if (!(opll->mask & OPLL_MASK_CYM)) {
+      skip_rhythm_output(opll, SLOT_CYM, &out[13], stale);
+    }
+  }
+  opll->stale_mask = stale[0] | stale[1];
+
+  if ((opll->inp_count & (IDLE_SCAN_INTERVAL - 1)) == 0)
+    update_idle_slots(opll);
+
+  opll->inp_count++;
+}
+
+/* whether the next queued write is applied within the two internal samples after the current one. */
+static int is_write_near(OPLL *opll) {
+  const struct __OPLL_WRITE *w;
+  int32_t d;
+
+  if (opll->wq_head == opll->wq_tail)
+    return 0;
+
+  w = &opll->write_queue[opll->wq_head];
+  if (w->flags & WRITE_AT_SAMPLE) {
+    /* applied at the first internal sample after the output sample w->time - 1 is completed. */
+    d = (int32_t)(w->time - opll->out_count);
+    return d > 0 && (uint64_t)d * opll->out_step - opll->out_time <= (uint64_t)opll->inp_step * 2;
+  }
+  d = (int32_t)(w->time - opll->inp_count);
+  return d > 0 && d <= 2;
+}
+
+/* number of the last internal samples to be calculated in full: the longest converter history, and at least 2. */
+static uint32_t get_advance_window(OPLL *opll) {
+  uint32_t window = 2;
+  int i;
+  if (opll->conv) {
+    window = max(window, opll->conv->taps);
+  }
+  for (i = 0; i < OPLL_OUTPUT_MAX; i++) {
+    if (opll->output[i] && opll->output[i]->conv) {
+      window = max(window, opll->output[i]->conv->taps);
+    }
+  }
+  return window;
+}
+
+/* catch up the phases, the noise and the converters with `n` internal samples calculated by update_state. */
+static void catch_up_skipped(OPLL *opll, uint64_t n) {
+  int i;
+
+  for (i = 0; i < 18; i++) {
+    if ((opll->defer_mask >> i) & 1) {
+      catch_up_phase(opll, i);
+    }
+  }
+  opll->defer_mask = 0;
+  opll->hold_mask = 0;
+  jump_noise(opll, n * 18);
+  if (opll->conv) {
+    skip_rate_conv(opll->conv, opll->stereo_out ? 2 : 1, n, 0);
+  }
+  for (i = 0; i < OPLL_OUTPUT_MAX; i++) {
+    struct __OPLL_OUTPUT *o = opll->output[i];
+    uint64_t t;
+    if (o == NULL)
+      continue;
+    t = o->out_time + n * o->inp_step;
+    o->out_time = (uint32_t)(t % o->out_step);
+    if (o->conv) {
+      skip_rate_conv(o->conv, o->ch, n, t / o->out_step);
+    }
+  }
+}
+
+/***********************************************************
+
+                   External Interfaces
+
+***********************************************************/
+
+size_t OPLL_sizeof(void) { return sizeof(OPLL); }
+
+OPLL *OPLL_init(void *mem, uint32_t clk, uint32_t rate) {
+  OPLL *opll = (OPLL *)mem;
+  int i;
+
+  if (opll == NULL)
+    return NULL;
+
+  memset(opll, 0, sizeof(OPLL));
+  for (i = 0; i < 2; i++)
+    memcpy(&opll->user_patch[i], &null_patch, sizeof(OPLL_PATCH));
+  opll->rom_patch = default_patch[0];
+  opll->rom_copy = NULL;
+
+  opll->clk = clk;
+  opll->rate = rate;
+  opll->mask = 0;
+  opll->conv = NULL;
+  opll->conv_store = NULL;
+  opll->coef_spare = NULL;
+  OPLL_RateConv_getDefaultConfig(&opll->conv_config);
+  /* allocated here, so that queueing a write on the audio thread never allocates */
+  opll->write_queue = (struct __OPLL_WRITE *)opll_alloc(sizeof(struct __OPLL_WRITE) * OPLL_WRITE_QUEUE_SIZE);
+  if (opll->write_queue == NULL)
+    return NULL;
+  opll->mix_out[0] = 0;
+  opll->mix_out[1] = 0;
+
+  OPLL_reset(opll);
+  OPLL_setChipType(opll, 0);
+  OPLL_resetPatch(opll, 0);
+  return opll;
+}
+
+OPLL *OPLL_new(uint32_t clk, uint32_t rate) {
+  void *mem = opll_alloc_aligned(sizeof(OPLL));
+  OPLL *opll;
+  if (mem == NULL)
+    return NULL;
+  opll = OPLL_init(mem, clk, rate);
+  if (opll == NULL)
+    opll_free_aligned(mem);
+  return opll;
+}
+
+static void free_rate_converter(OPLL *opll) {
+  if (opll->conv_store) {
+    OPLL_RateConv_delete(opll->conv_store);
+    opll->conv_store = NULL;
+  }
+  if (opll->coef_spare) {
+    release_coef_table(opll->coef_spare);
+    opll->coef_spare = NULL;
+  }
+  opll->conv = NULL;
+}
+
+static int alloc_rate_converter(OPLL *opll) {
+  if (opll->conv_store == NULL) {
+    opll->conv_store = rate_conv_alloc(2, &opll->conv_config);
+  }
+  return opll->conv_store != NULL;
+}
+
+void OPLL_deinit(OPLL *opll) {
+  int i;
+  for (i = 0; i < OPLL_OUTPUT_MAX; i++) {
+    OPLL_removeOutput(opll, i);
+  }
+  free_rate_converter(opll);
+  opll_free(opll->write_queue);
+  opll->write_queue = NULL;
+  opll_free(opll->rom_copy);
+  opll->rom_copy = NULL;
+}
+
+void OPLL_delete(OPLL *opll) {
+  OPLL_deinit(opll);
+  opll_free_aligned(opll);
+}
+
+/*
+ * The memory of the converter is allocated once for the settings and kept for any rate, even while the converter is
+ * disabled, so that only the ratio and possibly the filter bank are replaced here.
+ */
+static void reset_rate_conversion_params(OPLL *opll) {
+  /* both steps are scaled by 72 to keep them integer. */
+  opll->out_time = 0;
+  opll->out_step = opll->clk;
+  opll->inp_step = opll->rate * 72;
+  opll->conv = NULL;
+
+  if (!needs_rate_conv(opll->clk, opll->rate))
+    return;
+
+  if (!alloc_rate_converter(opll))
+    return;
+  if (rate_conv_set_ratio(opll->conv_store, opll->clk, opll->rate * 72, &opll->coef_spare)) {
+    opll->conv = opll->conv_store;
+    OPLL_RateConv_reset(opll->conv);
+  }
+}
+
+void OPLL_reset(OPLL *opll) {
+  int i;
+
+  if (!opll)
+    return;
+
+  opll->adr = 0;
+
+  opll->pm_phase = 0;
+  opll->am_phase = 0;
+  opll->pg_inc_step = PG_INC_STALE;
+
+  opll->noise = 0x1;
+  opll->noise_lag = 0;
+  opll->mask = 0;
 
   opll->rhythm_mode = 0;
   opll->slot_key_status = 0;
   opll->eg_counter = 0;
 
+  opll->inp_count = 0;
+  opll->out_count = 0;
+  opll->wq_head = opll->wq_tail = 0;
+
   reset_rate_conversion_params(opll);
+  for (i = 0; i < OPLL_OUTPUT_MAX; i++) {
+    if (opll->output[i])
+      reset_output(opll, opll->output[i]);
+  }
 
+  opll->idle_mask = 0;
+  opll->recon_mask = 0;
+  opll->stale_mask = 0;
+  opll->defer_mask = 0;
+  opll->hold_mask = 0;
+  opll->eg_sleep_mask = 0;
   for (i = 0; i < 18; i++)
-    reset_slot(&opll->slot[i], i);
+    reset_slot(opll, i);
 
   for (i = 0; i < 9; i++) {
     set_patch(opll, i, 0);
@@ -1172,7 +2845,12 @@ void OPLL_reset(OPLL *opll) {
     opll->pan_fine[i][1] = opll->pan_fine[i][0] = 1.0f;
   }
 
+  memset(opll->mix_gain, 0, sizeof(opll->mix_gain));
   for (i = 0; i < 14; i++) {
+    update_pan_gain(opll, i);
+  }
+
+  for (i = 0; i < 16; i++) {
     opll->ch_out[i] = 0;
   }
 }
@@ -1183,6 +2861,7 @@ void OPLL_forceRefresh(OPLL *opll) {
   if (opll == NULL)
     return;
 
+  wake_slots(opll, ALL_SLOTS);
   for (i = 0; i < 9; i++) {
     set_patch(opll, i, opll->patch_number[i]);
   }
@@ -1197,6 +2876,56 @@ void OPLL_setRate(OPLL *opll, uint32_t rate) {
   reset_rate_conversion_params(opll);
 }
 
+int OPLL_prepareRate(OPLL *opll, uint32_t rate) {
+  struct __OPLL_RateConvCoef *e;
+  uint32_t num = opll->clk, den = rate * 72;
+
+  if (!needs_rate_conv(opll->clk, rate))
+    return 1;
+
+  if (!alloc_rate_converter(opll))
+    return 0;
+  get_coef_key(opll->conv_store, &num, &den);
+  e = opll->conv_store->coef_entry;
+  if (e && coef_table_matches(e, opll->conv_store, num, den))
+    return 1;
+  e = opll->coef_spare;
+  if (e && coef_table_matches(e, opll->conv_store, num, den))
+    return 1;
+
+  e = acquire_coef_table(opll->conv_store, num, den);
+  if (e == NULL)
+    return 0;
+  if (opll->coef_spare)
+    release_coef_table(opll->coef_spare);
+  opll->coef_spare = e;
+  return 1;
+}
+
+void OPLL_setRateConvConfig(OPLL *opll, const OPLL_RateConvConfig *config) {
+  int i;
+  if (config) {
+    opll->conv_config = *config;
+  } else {
+    OPLL_RateConv_getDefaultConfig(&opll->conv_config);
+  }
+  free_rate_converter(opll);
+  reset_rate_conversion_params(opll);
+  for (i = 0; i < OPLL_OUTPUT_MAX; i++) {
+    if (opll->output[i])
+      init_output_conv(opll, opll->output[i]);
+  }
+}
+
+double OPLL_getLatency(OPLL *opll) {
+  double delay;
+  if (!opll->conv)
+    return 0.0;
+  /* the internal samples are computed up to the end of the output period, which is one output sample ahead. */
+  delay = OPLL_RateConv_getDelay(opll->conv) - 1.0;
+  return delay > 0.0 ? delay : 0.0;
+}
+
 void OPLL_setQuality(OPLL *opll, uint8_t q) {}
 
 void OPLL_setChipType(OPLL *opll, uint8_t type) { opll->chip_type = type; }
@@ -1213,37 +2942,38 @@ void OPLL_writeReg(OPLL *opll, uint32_t reg, uint8_t data) {
   }
 
   opll->reg[reg] = (uint8_t)data;
+  wake_slots(opll, get_write_slots(opll, reg));
 
   switch (reg) {
   case 0x00:
-    opll->patch[0].AM = (data >> 7) & 1;
-    opll->patch[0].PM = (data >> 6) & 1;
-    opll->patch[0].EG = (data >> 5) & 1;
-    opll->patch[0].KR = (data >> 4) & 1;
-    opll->patch[0].ML = (data)&15;
+    opll->user_patch[0].AM = (data >> 7) & 1;
+    opll->user_patch[0].PM = (data >> 6) & 1;
+    opll->user_patch[0].EG = (data >> 5) & 1;
+    opll->user_patch[0].KR = (data >> 4) & 1;
+    opll->user_patch[0].ML = (data)&15;
     for (i = 0; i < 9; i++) {
       if (opll->patch_number[i] == 0) {
-        request_update(MOD(opll, i), UPDATE_RKS | UPDATE_EG);
+        request_update(MOD(opll, i), UPDATE_RKS | UPDATE_EG | UPDATE_PG);
       }
     }
     break;
 
   case 0x01:
-    opll->patch[1].AM = (data >> 7) & 1;
-    opll->patch[1].PM = (data >> 6) & 1;
-    opll->patch[1].EG = (data >> 5) & 1;
-    opll->patch[1].KR = (data >> 4) & 1;
-    opll->patch[1].ML = (data)&15;
+    opll->user_patch[1].AM = (data >> 7) & 1;
+    opll->user_patch[1].PM = (data >> 6) & 1;
+    opll->user_patch[1].EG = (data >> 5) & 1;
+    opll->user_patch[1].KR = (data >> 4) & 1;
+    opll->user_patch[1].ML = (data)&15;
     for (i = 0; i < 9; i++) {
       if (opll->patch_number[i] == 0) {
-        request_update(CAR(opll, i), UPDATE_RKS | UPDATE_EG);
+        request_update(CAR(opll, i), UPDATE_RKS | UPDATE_EG | UPDATE_PG);
       }
     }
     break;
 
   case 0x02:
-    opll->patch[0].KL = (data >> 6) & 3;
-    opll->patch[0].TL = (data)&63;
+    opll->user_patch[0].KL = (data >> 6) & 3;
+    opll->user_patch[0].TL = (data)&63;
     for (i = 0; i < 9; i++) {
       if (opll->patch_number[i] == 0) {
         request_update(MOD(opll, i), UPDATE_TLL);
@@ -1252,10 +2982,10 @@ void OPLL_writeReg(OPLL *opll, uint32_t reg, uint8_t data) {
     break;
 
   case 0x03:
-    opll->patch[1].KL = (data >> 6) & 3;
-    opll->patch[1].WS = (data >> 4) & 1;
-    opll->patch[0].WS = (data >> 3) & 1;
-    opll->patch[0].FB = (data)&7;
+    opll->user_patch[1].KL = (data >> 6) & 3;
+    opll->user_patch[1].WS = (data >> 4) & 1;
+    opll->user_patch[0].WS = (data >> 3) & 1;
+    opll->user_patch[0].FB = (data)&7;
     for (i = 0; i < 9; i++) {
       if (opll->patch_number[i] == 0) {
         request_update(MOD(opll, i), UPDATE_WS);
@@ -1265,8 +2995,8 @@ void OPLL_writeReg(OPLL *opll, uint32_t reg, uint8_t data) {
     break;
 
   case 0x04:
-    opll->patch[0].AR = (data >> 4) & 15;
-    opll->patch[0].DR = (data)&15;
+    opll->user_patch[0].AR = (data >> 4) & 15;
+    opll->user_patch[0].DR = (data)&15;
     for (i = 0; i < 9; i++) {
       if (opll->patch_number[i] == 0) {
         request_update(MOD(opll, i), UPDATE_EG);
@@ -1275,8 +3005,8 @@ void OPLL_writeReg(OPLL *opll, uint32_t reg, uint8_t data) {
     break;
 
   case 0x05:
-    opll->patch[1].AR = (data >> 4) & 15;
-    opll->patch[1].DR = (data)&15;
+    opll->user_patch[1].AR = (data >> 4) & 15;
+    opll->user_patch[1].DR = (data)&15;
     for (i = 0; i < 9; i++) {
       if (opll->patch_number[i] == 0) {
         request_update(CAR(opll, i), UPDATE_EG);
@@ -1285,8 +3015,8 @@ void OPLL_writeReg(OPLL *opll, uint32_t reg, uint8_t data) {
     break;
 
   case 0x06:
-    opll->patch[0].SL = (data >> 4) & 15;
-    opll->patch[0].RR = (data)&15;
+    opll->user_patch[0].SL = (data >> 4) & 15;
+    opll->user_patch[0].RR = (data)&15;
     for (i = 0; i < 9; i++) {
       if (opll->patch_number[i] == 0) {
         request_update(MOD(opll, i), UPDATE_EG);
@@ -1295,8 +3025,8 @@ void OPLL_writeReg(OPLL *opll, uint32_t reg, uint8_t data) {
     break;
 
   case 0x07:
-    opll->patch[1].SL = (data >> 4) & 15;
-    opll->patch[1].RR = (data)&15;
+    opll->user_patch[1].SL = (data >> 4) & 15;
+    opll->user_patch[1].RR = (data)&15;
     for (i = 0; i < 9; i++) {
       if (opll->patch_number[i] == 0) {
         request_update(CAR(opll, i), UPDATE_EG);
@@ -1382,11 +3112,131 @@ void OPLL_writeIO(OPLL *opll, uint32_t adr, uint8_t val) {
     opll->adr = val;
 }
 
-void OPLL_setPan(OPLL *opll, uint32_t ch, uint8_t pan) { opll->pan[ch & 15] = pan; }
+static int queue_write(OPLL *opll, uint32_t time, uint8_t flags, uint32_t reg, uint8_t val) {
+  struct __OPLL_WRITE *w;
+  const uint32_t next = (opll->wq_tail + 1) % OPLL_WRITE_QUEUE_SIZE;
+
+  if (next == opll->wq_head)
+    return 0;
+
+  w = &opll->write_queue[opll->wq_tail];
+  w->time = time;
+  w->flags = flags;
+  w->reg = (uint8_t)reg;
+  w->data = val;
+  opll->wq_tail = next;
+  return 1;
+}
+
+int OPLL_writeRegAt(OPLL *opll, uint32_t time, uint32_t reg, uint8_t val) {
+  if (reg >= 0x40)
+    return 0;
+  return queue_write(opll, time, 0, reg, val);
+}
+
+int OPLL_writeRegAtSample(OPLL *opll, uint32_t sample, uint32_t reg, uint8_t val) {
+  if (reg >= 0x40)
+    return 0;
+  return queue_write(opll, sample, WRITE_AT_SAMPLE, reg, val);
+}
+
+void OPLL_clearWriteQueue(OPLL *opll) { opll->wq_head = opll->wq_tail = 0; }
+
+uint32_t OPLL_getTime(OPLL *opll) { return opll->inp_count; }
+
+uint32_t OPLL_getSampleCount(OPLL *opll) { return opll->out_count; }
+
+int OPLL_addOutput(OPLL *opll, uint32_t rate, int mode, uint32_t capacity) {
+  struct __OPLL_OUTPUT *o;
+  int i;
+
+  if ((mode != OPLL_OUTPUT_MONO && mode != OPLL_OUTPUT_STEREO && mode != OPLL_OUTPUT_BUSES &&
+       mode != OPLL_OUTPUT_STEMS) ||
+      rate == 0 || capacity == 0)
+    return -1;
+
+  for (i = 0; i < OPLL_OUTPUT_MAX; i++) {
+    if (opll->output[i] == NULL)
+      break;
+  }
+  if (i == OPLL_OUTPUT_MAX)
+    return -1;
+
+  o = opll_alloc(sizeof(struct __OPLL_OUTPUT) + sizeof(o->fifo[0]) * capacity * mode);
+  if (o == NULL)
+    return -1;
+  o->rate = rate;
+  o->ch = mode;
+  o->conv = NULL;
+  o->fifo = (int16_t *)(o + 1);
+  o->capacity = capacity;
+  init_output_conv(opll, o);
+  if (o->conv == NULL && needs_rate_conv(opll->clk, rate)) {
+    opll_free(o);
+    return -1;
+  }
+
+  opll->output[i] = o;
+  opll->num_outputs++;
+  return i;
+}
+
+void OPLL_removeOutput(OPLL *opll, int index) {
+  struct __OPLL_OUTPUT *o;
+
+  if (index < 0 || index >= OPLL_OUTPUT_MAX || opll->output[index] == NULL)
+    return;
+
+  o = opll->output[index];
+  if (o->conv)
+    OPLL_RateConv_delete(o->conv);
+  opll_free(o);
+  opll->output[index] = NULL;
+  opll->num_outputs--;
+}
+
+uint32_t OPLL_getOutputFrames(OPLL *opll, int index) {
+  if (index < 0 || index >= OPLL_OUTPUT_MAX || opll->output[index] == NULL)
+    return 0;
+  return opll->output[index]->count;
+}
+
+uint32_t OPLL_readOutput(OPLL *opll, int index, int16_t *out, uint32_t frames) {
+  struct __OPLL_OUTPUT *o;
+  uint32_t n, i;
+
+  if (index < 0 || index >= OPLL_OUTPUT_MAX || opll->output[index] == NULL)
+    return 0;
+
+  o = opll->output[index];
+  frames = min(frames, o->count);
+  for (i = 0; i < frames; i += n) {
+    n = min(frames - i, o->capacity - o->read);
+    memcpy(out + i * o->ch, o->fifo + o->read * o->ch, sizeof(o->fifo[0]) * n * o->ch);
+    o->read += n;
+    if (o->read == o->capacity)
+      o->read = 0;
+  }
+  o->count -= frames;
+  return frames;
+}
+
+void OPLL_setPan(OPLL *opll, uint32_t ch, uint8_t pan) {
+  opll->pan[ch & 15] = pan;
+  update_pan_gain(opll, ch & 15);
+}
 
 void OPLL_setPanFine(OPLL *opll, uint32_t ch, float pan[2]) {
   opll->pan_fine[ch & 15][0] = pan[0];
   opll->pan_fine[ch & 15][1] = pan[1];
+  update_pan_gain(opll, ch & 15);
+}
+
+int OPLL_setBusGain(OPLL *opll, uint32_t bus, uint32_t ch, float gain) {
+  if (bus < 2 || bus >= OPLL_BUS_MAX || ch >= 14 || !(-2.0f <= gain && gain < 2.0f))
+    return 0;
+  opll->mix_gain[bus][ch] = to_mix_gain(gain);
+  return 1;
 }
 
 void OPLL_dumpToPatch(const uint8_t *dump, OPLL_PATCH *patch) {
@@ -1419,17 +3269,69 @@ void OPLL_dumpToPatch(const uint8_t *dump, OPLL_PATCH *patch) {
 }
 
 void OPLL_getDefaultPatch(int32_t type, int32_t num, OPLL_PATCH *patch) {
-  OPLL_dumpToPatch(default_inst[type] + num * 8, patch);
+  memcpy(patch, &default_patch[type][num * 2], sizeof(OPLL_PATCH) * 2);
+}
+
+/* switch the ROM set. The slots keep their patch numbers. */
+static void set_rom_patch(OPLL *opll, const OPLL_PATCH *rom) {
+  int i;
+  for (i = 0; i < 18; i++) {
+    const OPLL_PATCH *patch = opll->slot[i].patch;
+    if (patch != &opll->user_patch[0] && patch != &opll->user_patch[1] && patch != &null_patch)
+      opll->slot[i].patch = rom + (patch - opll->rom_patch);
+  }
+  opll->rom_patch = rom;
+}
+
+/* the memory of the private ROM set, allocated once and kept until the chip is deleted. */
+static int reserve_rom_copy(OPLL *opll) {
+  if (opll->rom_copy == NULL) {
+    opll->rom_copy = opll_alloc(sizeof(OPLL_PATCH) * 19 * 2);
+  }
+  return opll->rom_copy != NULL;
+}
+
+/* the private ROM set, which is made from the current one on the first change. */
+static OPLL_PATCH *get_rom_copy(OPLL *opll) {
+  if (!reserve_rom_copy(opll))
+    return NULL;
+  if (opll->rom_patch != opll->rom_copy) {
+    memcpy(opll->rom_copy, opll->rom_patch, sizeof(OPLL_PATCH) * 19 * 2);
+    set_rom_patch(opll, opll->rom_copy);
+  }
+  return opll->rom_copy;
+}
+
+/* use the built-in set equal to `rom` if any, or a private copy of it. Returns 0 if the copy cannot be allocated. */
+static int select_rom_patch(OPLL *opll, const OPLL_PATCH *rom) {
+  OPLL_PATCH *copy;
+  int i;
+
+  for (i = 0; i < OPLL_TONE_NUM; i++) {
+    if (memcmp(rom + 2, default_patch[i] + 2, sizeof(OPLL_PATCH) * 18 * 2) == 0) {
+      set_rom_patch(opll, default_patch[i]);
+      return 1;
+    }
+  }
+  copy = get_rom_copy(opll);
+  if (copy == NULL)
+    return 0;
+  memcpy(copy + 2, rom + 2, sizeof(OPLL_PATCH) * 18 * 2);
+  return 1;
 }
 
-void OPLL_setPatch(OPLL *opll, const uint8_t *dump) {
-  OPLL_PATCH patch[2];
+int OPLL_setPatch(OPLL *opll, const uint8_t *dump) {
+  OPLL_PATCH patch[19 * 2];
   int i;
+  wake_slots(opll, ALL_SLOTS);
   for (i = 0; i < 19; i++) {
-    OPLL_dumpToPatch(dump + i * 8, patch);
-    memcpy(&opll->patch[i * 2 + 0], &patch[0], sizeof(OPLL_PATCH));
-    memcpy(&opll->patch[i * 2 + 1], &patch[1], sizeof(OPLL_PATCH));
+    OPLL_dumpToPatch(dump + i * 8, &patch[i * 2]);
   }
+  if (!select_rom_patch(opll, patch))
+    return 0;
+  memcpy(opll->user_patch, patch, sizeof(OPLL_PATCH) * 2);
+  opll->pg_inc_step = PG_INC_STALE;
+  return 1;
 }
 
 void OPLL_patchToDump(const OPLL_PATCH *patch, uint8_t *dump) {
@@ -1443,49 +3345,180 @@ void OPLL_patchToDump(const OPLL_PATCH *patch, uint8_t *dump) {
   dump[7] = (uint8_t)((patch[1].SL << 4) + patch[1].RR);
 }
 
-void OPLL_copyPatch(OPLL *opll, int32_t num, OPLL_PATCH *patch) {
-  memcpy(&opll->patch[num], patch, sizeof(OPLL_PATCH));
+int OPLL_copyPatch(OPLL *opll, int32_t num, OPLL_PATCH *patch) {
+  OPLL_PATCH *rom;
+  wake_slots(opll, ALL_SLOTS);
+  if (num < 2) {
+    memcpy(&opll->user_patch[num], patch, sizeof(OPLL_PATCH));
+  } else if (memcmp(&opll->rom_patch[num], patch, sizeof(OPLL_PATCH)) != 0) {
+    rom = get_rom_copy(opll);
+    if (rom == NULL)
+      return 0;
+    memcpy(&rom[num], patch, sizeof(OPLL_PATCH));
+  }
+  opll->pg_inc_step = PG_INC_STALE;
+  return 1;
+}
+
+void OPLL_getPatch(OPLL *opll, int32_t num, OPLL_PATCH *patch) {
+  if (0 <= num && num < 19 * 2)
+    memcpy(patch, get_patch(opll, num), sizeof(OPLL_PATCH));
 }
 
 void OPLL_resetPatch(OPLL *opll, uint8_t type) {
-  int i;
-  for (i = 0; i < 19 * 2; i++)
-    OPLL_copyPatch(opll, i, &default_patch[type % OPLL_TONE_NUM][i]);
+  const OPLL_PATCH *rom = default_patch[type % OPLL_TONE_NUM];
+  wake_slots(opll, ALL_SLOTS);
+  memcpy(opll->user_patch, rom, sizeof(OPLL_PATCH) * 2);
+  set_rom_patch(opll, rom);
+  opll->pg_inc_step = PG_INC_STALE;
 }
 
-int16_t OPLL_calc(OPLL *opll) {
+int OPLL_preparePatch(OPLL *opll) { return reserve_rom_copy(opll); }
+
+static INLINE int16_t calc_mono_frame(OPLL *opll) {
+  opll->stereo_out = 0;
   while (opll->out_step > opll->out_time) {
     opll->out_time += opll->inp_step;
     update_output(opll);
     mix_output(opll);
   }
   opll->out_time -= opll->out_step;
+  opll->out_count++;
   if (opll->conv) {
     opll->mix_out[0] = OPLL_RateConv_getData(opll->conv, 0);
   }
   return opll->mix_out[0];
 }
 
-void OPLL_calcStereo(OPLL *opll, int32_t out[2]) {
+static INLINE void calc_stereo_frame(OPLL *opll, int16_t out[2]) {
+  opll->stereo_out = 1;
   while (opll->out_step > opll->out_time) {
     opll->out_time += opll->inp_step;
     update_output(opll);
     mix_output_stereo(opll);
   }
   opll->out_time -= opll->out_step;
+  opll->out_count++;
   if (opll->conv) {
-    out[0] = OPLL_RateConv_getData(opll->conv, 0);
-    out[1] = OPLL_RateConv_getData(opll->conv, 1);
+    rate_conv_get_stereo(opll->conv, out);
   } else {
     out[0] = opll->mix_out[0];
     out[1] = opll->mix_out[1];
   }
 }
 
+int16_t OPLL_calc(OPLL *opll) { return calc_mono_frame(opll); }
+
+void OPLL_calcStereo(OPLL *opll, int32_t out[2]) {
+  int16_t buf[2];
+  calc_stereo_frame(opll, buf);
+  out[0] = buf[0];
+  out[1] = buf[1];
+}
+
+void OPLL_calcBlock(OPLL *opll, int16_t *out, uint32_t frames) {
+  uint32_t i;
+  for (i = 0; i < frames; i++) {
+    out[i] = calc_mono_frame(opll);
+  }
+}
+
+void OPLL_calcStereoBlock(OPLL *opll, int32_t *out, uint32_t frames) {
+  int16_t buf[2];
+  uint32_t i;
+  for (i = 0; i < frames; i++) {
+    calc_stereo_frame(opll, buf);
+    out[i * 2 + 0] = buf[0];
+    out[i * 2 + 1] = buf[1];
+  }
+}
+
+void OPLL_calcStereoBlock16(OPLL *opll, int16_t *out, uint32_t frames) {
+  uint32_t i;
+  for (i = 0; i < frames; i++) {
+    calc_stereo_frame(opll, out + i * 2);
+  }
+}
+
+void OPLL_calcStereoBlockPlanar(OPLL *opll, int32_t *left, int32_t *right, uint32_t frames) {
+  int16_t buf[2];
+  uint32_t i;
+  for (i = 0; i < frames; i++) {
+    calc_stereo_frame(opll, buf);
+    left[i] = buf[0];
+    right[i] = buf[1];
+  }
+}
+
+void OPLL_advance(OPLL *opll, uint32_t frames) {
+  const uint64_t end = (uint64_t)frames * opll->out_step;
+  const uint64_t total = end > opll->out_time ? (end - opll->out_time + opll->inp_step - 1) / opll->inp_step : 0;
+  const uint32_t window = get_advance_window(opll);
+  uint32_t stale[2] = {0, 0};
+  uint64_t t = 0, skipped = 0;
+  uint32_t i;
+
+  for (i = 0; i < frames; i++) {
+    while (opll->out_step > opll->out_time) {
+      const uint32_t wq_head = opll->wq_head;
+      if (opll->wq_head != opll->wq_tail) {
+        process_write_queue(opll);
+      }
+      if (total - t <= window || is_write_near(opll)) {
+        if (skipped) {
+          catch_up_skipped(opll, skipped);
+          skipped = 0;
+        }
+        /* the slots calculated now will have an exact output[0], and output[1] if output[0] was exact. */
+        opll->stale_mask = stale[0];
+        opll->out_time += opll->inp_step;
+        update_output(opll);
+        if (opll->stereo_out) {
+          mix_output_stereo(opll);
+        } else {
+          mix_output(opll);
+        }
+        stale[1] = stale[0];
+        stale[0] = 0;
+      } else {
+        if (skipped == 0 || wq_head != opll->wq_head || (opll->inp_count & (IDLE_SCAN_INTERVAL - 1)) == 0) {
+          update_defer_mask(opll);
+        }
+        opll->out_time += opll->inp_step;
+        update_state(opll, stale);
+        skipped++;
+      }
+      t++;
+    }
+    opll->out_time -= opll->out_step;
+    opll->out_count++;
+  }
+
+  if (skipped) {
+    catch_up_skipped(opll, skipped);
+  }
+  opll->stale_mask = 0;
+  if (opll->conv && frames > 0) {
+    skip_rate_conv(opll->conv, 0, 0, frames - 1);
+    if (opll->stereo_out) {
+      skip_rate_conv(opll->conv, 0, 0, 1);
+    } else {
+      /* mix_out keeps the last mono sample */
+      opll->mix_out[0] = OPLL_RateConv_getData(opll->conv, 0);
+    }
+  }
+  for (i = 0; i < OPLL_OUTPUT_MAX; i++) {
+    if (opll->output[i]) {
+      opll->output[i]->read = opll->output[i]->count = 0;
+    }
+  }
+}
+
 uint32_t OPLL_setMask(OPLL *opll, uint32_t mask) {
   uint32_t ret;
 
   if (opll) {
+    wake_slots(opll, ALL_SLOTS);
     ret = opll->mask;
     opll->mask = mask;
     return ret;
@@ -1497,9 +3530,559 @@ uint32_t OPLL_toggleMask(OPLL *opll, uint32_t mask) {
   uint32_t ret;
 
   if (opll) {
+    wake_slots(opll, ALL_SLOTS);
     ret = opll->mask;
     opll->mask ^= mask;
     return ret;
   } else
     return 0;
 }
+
+/***********************************************************
+
+                   State Snapshot
+
+***********************************************************/
+/*
+ * The state is a little-endian byte stream:
+ *   header  magic "OPLL", version, taps of the rate converter (0 if none), clock and rate
+ *   chip    registers, LFO, noise, counters, patches and the last outputs
+ *   slots   envelope and phase of each slot. The patch and the wave table are stored as indices.
+ *   conv    position of the rate converter and the last `taps` input samples of both channels, oldest first
+ * Idle slots are saved as if they were awake, so the state does not depend on the idle scan.
+ */
+#define STATE_VERSION 1
+#define STATE_HEADER_SIZE (4 + 1 + 1 + 4 + 4)
+#define STATE_CHIP_SIZE (0x40 + 7 + 4 * 8 + 9 + 19 * 8 + 2 * 16)
+#define STATE_SLOT_SIZE (14 + 2 * 5 + 4)
+#define STATE_CONV_SIZE(taps) ((taps) ? 1 + 4 + 2 * 2 * (taps) : 0)
+
+static const uint8_t state_magic[4] = {'O', 'P', 'L', 'L'};
+
+static INLINE void put8(uint8_t **p, uint32_t v) { *(*p)++ = (uint8_t)v; }
+
+static INLINE void put16(uint8_t **p, uint32_t v) {
+  put8(p, v);
+  put8(p, v >> 8);
+}
+
+static INLINE void put32(uint8_t **p, uint32_t v) {
+  put16(p, v);
+  put16(p, v >> 16);
+}
+
+static INLINE uint32_t get8(const uint8_t **p) { return *(*p)++; }
+
+static INLINE uint32_t get16(const uint8_t **p) {
+  const uint32_t lo = get8(p);
+  return lo | (get8(p) << 8);
+}
+
+static INLINE uint32_t get32(const uint8_t **p) {
+  const uint32_t lo = get16(p);
+  return lo | (get16(p) << 16);
+}
+
+static INLINE uint32_t get_state_taps(OPLL *opll) { return opll->conv ? (uint32_t)opll->conv->taps : 0; }
+
+static INLINE uint32_t get_state_size(uint32_t taps) {
+  return STATE_HEADER_SIZE + STATE_CHIP_SIZE + STATE_SLOT_SIZE * 18 + STATE_CONV_SIZE(taps);
+}
+
+static void save_slot(OPLL *opll, int i, uint8_t **p) {
+  const OPLL_SLOT slot = opll->slot[i];
+  uint32_t pg_phase = opll->pg_phase[i];
+  uint16_t pg_out = opll->pg_out[i];
+  int16_t output[2];
+
+  output[0] = opll->slot_out[i][0];
+  output[1] = opll->slot_out[i][1];
+  if (((opll->idle_mask >> i) & 1) && opll->pm_phase != slot.idle_pm_phase) {
+    pg_phase = caught_up_phase(opll, i);
+    pg_out = pg_phase >> DP_BASE_BITS;
+    if ((opll->recon_mask >> i) & 1) {
+      rebuild_output(opll, i, opll->pm_phase - slot.idle_pm_phase, pg_phase, output);
+    }
+  }
+
+  put8(p, slot.type);
+  put8(p, slot.pg_keep);
+  put8(p, get_patch_index(opll, slot.patch));
+  put8(p, slot.wave_mask == wave_mask_map[1]);
+  put8(p, slot.eg_state);
+  put8(p, slot.key_flag);
+  put8(p, slot.sus_flag);
+  put8(p, slot.volume);
+  put8(p, slot.rks);
+  put8(p, slot.eg_rate_h);
+  put8(p, slot.eg_rate_l);
+  put8(p, slot.eg_shift);
+  put8(p, opll->eg_out[i]);
+  put8(p, slot.update_requests);
+  put16(p, slot.blk_fnum);
+  put16(p, opll->tll[i]);
+  put16(p, pg_out);
+  put16(p, (uint16_t)output[0]);
+  put16(p, (uint16_t)output[1]);
+  put32(p, pg_phase);
+}
+
+/* patches are referred to in the array of `opll`. returns 0 if the slot refers to a table entry that does not exist, */
+/* or if a field is out of the range the chip can produce. rhythm_mode must be decoded before. */
+/* the patch number is returned in `patch`, since the ROM set is selected after all slots are decoded. */
+static int load_slot(OPLL *opll, int i, const uint8_t **p, uint8_t *patch) {
+  OPLL_SLOT *slot = &opll->slot[i];
+  /* the type is fixed by the position of the slot, see update_rhythm_mode */
+  const uint8_t type = (opll->rhythm_mode && i >= SLOT_HH) ? 3 : i & 1;
+  uint32_t ws;
+
+  slot->type = get8(p);
+  slot->pg_keep = get8(p);
+  *patch = get8(p);
+  ws = get8(p);
+  slot->eg_state = get8(p);
+  slot->key_flag = get8(p);
+  slot->sus_flag = get8(p);
+  slot->volume = get8(p);
+  slot->rks = get8(p);
+  slot->eg_rate_h = get8(p);
+  slot->eg_rate_l = get8(p);
+  slot->eg_shift = get8(p);
+  opll->eg_out[i] = get8(p);
+  slot->update_requests = get8(p);
+  slot->blk_fnum = get16(p) & 0xfff;
+  slot->fnum = slot->blk_fnum & 0x1ff;
+  slot->blk = slot->blk_fnum >> 9;
+  opll->tll[i] = get16(p);
+  opll->pg_out[i] = get16(p) & (PG_WIDTH - 1);
+  opll->slot_out[i][0] = (int16_t)get16(p);
+  opll->slot_out[i][1] = (int16_t)get16(p);
+  opll->pg_phase[i] = get32(p) & (DP_WIDTH - 1);
+  slot->idle_pm_phase = 0;
+
+  if (*patch >= 19 * 2 || ws > 1 || slot->eg_state > DAMP || opll->eg_out[i] > EG_MUTE || slot->eg_rate_h > 15 ||
+      slot->eg_rate_l > 3 || slot->eg_shift > 13) {
+    return 0;
+  }
+  if (slot->type != type || slot->pg_keep > 1 || slot->key_flag > 1 || slot->sus_flag > 1 || slot->volume > 63 ||
+      slot->rks > 15 || opll->tll[i] > kl_table[0x7f][3] + TL2EG(63)) {
+    return 0;
+  }
+  slot->wave_mask = wave_mask_map[ws];
+  return 1;
+}
+
+uint32_t OPLL_getStateSize(OPLL *opll) { return get_state_size(get_state_taps(opll)); }
+
+uint32_t OPLL_saveState(OPLL *opll, void *buf, uint32_t size) {
+  const uint32_t taps = get_state_taps(opll);
+  uint8_t *p = (uint8_t *)buf;
+  int i, ch;
+
+  if (size < get_state_size(taps))
+    return 0;
+
+  memcpy(p, state_magic, 4);
+  p += 4;
+  put8(&p, STATE_VERSION);
+  put8(&p, taps);
+  put32(&p, opll->clk);
+  put32(&p, opll->rate);
+
+  memcpy(p, opll->reg, 0x40);
+  p += 0x40;
+  put8(&p, opll->adr);
+  put8(&p, opll->test_flag);
+  put8(&p, opll->rhythm_mode);
+  put8(&p, opll->chip_type);
+  put8(&p, opll->lfo_am);
+  put8(&p, opll->short_noise);
+  put8(&p, opll->stereo_out);
+  put32(&p, opll->slot_key_status);
+  put32(&p, opll->eg_counter);
+  put32(&p, opll->pm_phase);
+  put32(&p, (uint32_t)opll->am_phase);
+  catch_up_noise(opll);
+  put32(&p, opll->noise);
+  put32(&p, opll->inp_count);
+  put32(&p, opll->out_count);
+  put32(&p, opll->out_time);
+  for (i = 0; i < 9; i++) {
+    put8(&p, opll->patch_number[i]);
+  }
+  for (i = 0; i < 19; i++) {
+    OPLL_patchToDump(get_patch(opll, i * 2), p);
+    p += 8;
+  }
+  for (i = 0; i < 14; i++) {
+    put16(&p, (uint16_t)opll->ch_out[i]);
+  }
+  put16(&p, (uint16_t)opll->mix_out[0]);
+  put16(&p, (uint16_t)opll->mix_out[1]);
+
+  for (i = 0; i < 18; i++) {
+    save_slot(opll, i, &p);
+  }
+
+  if (taps) {
+    put8(&p, opll->conv->phase);
+    put32(&p, opll->conv->rem);
+    for (ch = 0; ch < 2; ch++) {
+      const int16_t *hist = RATECONV_HISTORY(opll->conv, ch);
+      for (i = 0; i < (int)taps; i++) {
+        put16(&p, (uint16_t)hist[i]);
+      }
+    }
+  }
+
+  return (uint32_t)(p - (uint8_t *)buf);
+}
+
+int OPLL_loadState(OPLL *opll, const void *buf, uint32_t size) {
+  const uint32_t taps = get_state_taps(opll);
+  const uint8_t *p = (const uint8_t *)buf;
+  OPLL tmp;
+  OPLL_PATCH patch[19 * 2];
+  uint8_t patch_index[18];
+  uint32_t phase = 0, rem = 0;
+  int i, ch;
+
+  if (size < STATE_HEADER_SIZE || memcmp(p, state_magic, 4) != 0)
+    return 0;
+  p += 4;
+  if (get8(&p) != STATE_VERSION || get8(&p) != taps || get32(&p) != opll->clk || get32(&p) != opll->rate)
+    return 0;
+  if (size < get_state_size(taps))
+    return 0;
+
+  /* decode into a copy, so that the chip is left unchanged if the state is broken. */
+  tmp = *opll;
+  memcpy(tmp.reg, p, 0x40);
+  p += 0x40;
+  tmp.adr = get8(&p);
+  tmp.test_flag = get8(&p);
+  tmp.rhythm_mode = get8(&p);
+  if (tmp.rhythm_mode > 1)
+    return 0;
+  tmp.chip_type = get8(&p);
+  tmp.lfo_am = get8(&p);
+  tmp.short_noise = get8(&p);
+  tmp.stereo_out = get8(&p);
+  tmp.slot_key_status = get32(&p);
+  tmp.eg_counter = get32(&p);
+  tmp.pm_phase = get32(&p);
+  tmp.am_phase = (int32_t)get32(&p);
+  tmp.pg_inc_step = PG_INC_STALE;
+  tmp.noise = get32(&p);
+  tmp.noise_lag = 0;
+  tmp.inp_count = get32(&p);
+  tmp.out_count = get32(&p);
+  tmp.out_time = get32(&p);
+  for (i = 0; i < 9; i++) {
+    tmp.patch_number[i] = get8(&p);
+    if (tmp.patch_number[i] >= 19)
+      return 0;
+  }
+  for (i = 0; i < 19; i++) {
+    OPLL_dumpToPatch(p, &patch[i * 2]);
+    p += 8;
+  }
+  for (i = 0; i < 14; i++) {
+    tmp.ch_out[i] = (int16_t)get16(&p);
+  }
+  tmp.mix_out[0] = (int16_t)get16(&p);
+  tmp.mix_out[1] = (int16_t)get16(&p);
+
+  for (i = 0; i < 18; i++) {
+    if (!load_slot(&tmp, i, &p, &patch_index[i]))
+      return 0;
+  }
+
+  if (taps) {
+    phase = get8(&p);
+    rem = get32(&p);
+    if (rem >= opll->conv->den)
+      return 0;
+  }
+
+  /* the last step that can fail, so the ROM set is changed only when the state is accepted. */
+  if (!select_rom_patch(opll, patch))
+    return 0;
+  memcpy(tmp.user_patch, patch, sizeof(OPLL_PATCH) * 2);
+  tmp.rom_patch = opll->rom_patch;
+  tmp.rom_copy = opll->rom_copy;
+  for (i = 0; i < 18; i++) {
+    tmp.slot[i].patch = get_patch(opll, patch_index[i]);
+  }
+
+  tmp.idle_mask = 0;
+  tmp.recon_mask = 0;
+  tmp.stale_mask = 0;
+  tmp.defer_mask = 0;
+  tmp.hold_mask = 0;
+  tmp.eg_sleep_mask = 0;
+  tmp.wq_head = tmp.wq_tail = 0;
+  *opll = tmp;
+
+  if (taps) {
+    OPLL_RateConv_reset(opll->conv);
+    for (ch = 0; ch < 2; ch++) {
+      for (i = 0; i < (int)taps; i++) {
+        OPLL_RateConv_putData(opll->conv, ch, (int16_t)get16(&p));
+      }
+    }
+    opll->conv->phase = phase;
+    opll->conv->rem = rem;
+  }
+
+  /* the additional outputs are not in the state, they restart from silence */
+  for (i = 0; i < OPLL_OUTPUT_MAX; i++) {
+    if (opll->output[i]) {
+      reset_output(opll, opll->output[i]);
+    }
+  }
+
+  return 1;
+}
+
+/* mix a 32-bit word into the hash (FxHash step). */
+static INLINE uint64_t hash_word(uint64_t h, uint32_t v) {
+  return (((h << 5) | (h >> 59)) ^ v) * 0x517cc1b727220a95ull;
+}
+
+uint64_t OPLL_stateHash(OPLL *opll) {
+  uint64_t h = STATE_VERSION;
+  int i;
+
+  for (i = 0; i < 0x40; i += 4) {
+    const uint8_t *r = opll->reg + i;
+    h = hash_word(h, r[0] | r[1] << 8 | r[2] << 16 | (uint32_t)r[3] << 24);
+  }
+  h = hash_word(h, opll->eg_counter);
+  h = hash_word(h, opll->pm_phase);
+  h = hash_word(h, (uint32_t)opll->am_phase);
+  catch_up_noise(opll);
+  h = hash_word(h, opll->noise);
+
+  for (i = 0; i < 18; i++) {
+    const OPLL_SLOT slot = opll->slot[i];
+    const uint32_t pg_phase = ((opll->idle_mask >> i) & 1) ? caught_up_phase(opll, i) : opll->pg_phase[i];
+    /* pg_phase has 19 bits, eg_out 7, tll 9, rks and the rates 4, volume 6 and blk_fnum 12. */
+    h = hash_word(h, pg_phase | (uint32_t)slot.eg_state << 19 | (uint32_t)slot.key_flag << 22 |
+                         (uint32_t)slot.sus_flag << 23 | (uint32_t)opll->eg_out[i] << 24 | (uint32_t)slot.pg_keep << 31);
+    h = hash_word(h, opll->tll[i] | (uint32_t)slot.eg_shift << 16 | (uint32_t)slot.eg_rate_h << 20 |
+                         (uint32_t)slot.eg_rate_l << 24 | (uint32_t)slot.type << 26 | (uint32_t)slot.rks << 28);
+    h = hash_word(h, slot.blk_fnum | (uint32_t)slot.volume << 12 | slot.update_requests << 18 |
+                         (uint32_t)get_patch_index(opll, slot.patch) << 26);
+  }
+
+  /* finalizer of MurmurHash3 */
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+/***********************************************************
+
+                   Rewind
+
+***********************************************************/
+/*
+ * The newest state is kept in full and each older state as the XOR with the state after it, so stepping back applies
+ * one delta, and dropping the oldest state just discards its delta. Consecutive states differ in few bytes, so a delta
+ * is coded as runs of zeros and literal bytes, with the lengths as varints of 7 bits per byte:
+ *   repeat { zero run, literal run, literal bytes }
+ * The deltas are stored in a byte ring, each framed by its 16-bit length on both ends so that it can be removed from
+ * either end.
+ */
+struct __OPLL_Rewind {
+  uint8_t *ring;
+  uint32_t capacity;   /* size of ring in bytes */
+  uint32_t head;       /* position of the end of the newest delta */
+  uint32_t used;       /* bytes used by deltas */
+  uint32_t deltas;     /* number of deltas */
+  uint32_t state_size; /* size of the newest state, 0 if there is none */
+  uint8_t *state;      /* newest state */
+  uint8_t *work;       /* state being captured */
+  uint8_t *code;       /* delta being coded */
+  void *mem;           /* memory block holding all buffers */
+};
+
+#define REWIND_STATE_MAX get_state_size(LW_MAX)
+#define REWIND_CODE_MAX (REWIND_STATE_MAX * 3 / 2 + 8)
+
+static INLINE void put_varint(uint8_t **p, uint32_t v) {
+  while (v >= 0x80) {
+    put8(p, v | 0x80);
+    v >>= 7;
+  }
+  put8(p, v);
+}
+
+static INLINE uint32_t get_varint(const uint8_t **p) {
+  uint32_t v = 0, b;
+  int shift = 0;
+  do {
+    b = get8(p);
+    v |= (b & 0x7f) << shift;
+    shift += 7;
+  } while (b & 0x80);
+  return v;
+}
+
+/* code a ^ b and return the size of the code. */
+static uint32_t encode_delta(const uint8_t *a, const uint8_t *b, uint32_t size, uint8_t *code) {
+  uint8_t *p = code;
+  uint32_t i = 0, start, zeros;
+
+  while (i < size) {
+    start = i;
+    while (i < size && a[i] == b[i])
+      i++;
+    zeros = i - start;
+    start = i;
+    /* a single equal byte costs less inside a literal run than as a zero run */
+    while (i < size && (a[i] != b[i] || (i + 1 < size && a[i + 1] != b[i + 1])))
+      i++;
+    put_varint(&p, zeros);
+    put_varint(&p, i - start);
+    for (; start < i; start++) {
+      put8(&p, a[start] ^ b[start]);
+    }
+  }
+  return (uint32_t)(p - code);
+}
+
+static void apply_delta(const uint8_t *code, uint8_t *state, uint32_t size) {
+  const uint8_t *p = code;
+  uint32_t i = 0, n;
+
+  while (i < size) {
+    i += get_varint(&p);
+    for (n = get_varint(&p); n > 0; n--) {
+      state[i++] ^= get8(&p);
+    }
+  }
+}
+
+static void ring_write(OPLL_Rewind *rw, uint32_t pos, const uint8_t *src, uint32_t n) {
+  const uint32_t first = min(n, rw->capacity - pos);
+  memcpy(rw->ring + pos, src, first);
+  memcpy(rw->ring, src + first, n - first);
+}
+
+static void ring_read(OPLL_Rewind *rw, uint32_t pos, uint8_t *dst, uint32_t n) {
+  const uint32_t first = min(n, rw->capacity - pos);
+  memcpy(dst, rw->ring + pos, first);
+  memcpy(dst + first, rw->ring, n - first);
+}
+
+static uint32_t ring_read16(OPLL_Rewind *rw, uint32_t pos) {
+  uint8_t b[2];
+  ring_read(rw, pos % rw->capacity, b, 2);
+  return b[0] | (b[1] << 8);
+}
+
+static void drop_oldest_delta(OPLL_Rewind *rw) {
+  const uint32_t tail = (rw->head + rw->capacity - rw->used) % rw->capacity;
+  rw->used -= ring_read16(rw, tail) + 4;
+  rw->deltas--;
+}
+
+static void push_delta(OPLL_Rewind *rw, uint32_t len) {
+  uint8_t frame[2];
+
+  if (len + 4 > rw->capacity) {
+    /* older states are not reachable without this delta */
+    rw->head = rw->used = rw->deltas = 0;
+    return;
+  }
+  while (rw->used + len + 4 > rw->capacity) {
+    drop_oldest_delta(rw);
+  }
+  frame[0] = (uint8_t)len;
+  frame[1] = (uint8_t)(len >> 8);
+  ring_write(rw, rw->head, frame, 2);
+  ring_write(rw, (rw->head + 2) % rw->capacity, rw->code, len);
+  ring_write(rw, (rw->head + 2 + len) % rw->capacity, frame, 2);
+  rw->head = (rw->head + len + 4) % rw->capacity;
+  rw->used += len + 4;
+  rw->deltas++;
+}
+
+OPLL_Rewind *OPLL_Rewind_new(uint32_t capacity) {
+  OPLL_Rewind *rw = (OPLL_Rewind *)opll_alloc(sizeof(OPLL_Rewind));
+  uint8_t *mem;
+
+  if (rw == NULL)
+    return NULL;
+  mem = (uint8_t *)opll_alloc((size_t)REWIND_STATE_MAX * 2 + REWIND_CODE_MAX + capacity);
+  if (mem == NULL) {
+    opll_free(rw);
+    return NULL;
+  }
+  rw->mem = mem;
+  rw->state = mem;
+  rw->work = rw->state + REWIND_STATE_MAX;
+  rw->code = rw->work + REWIND_STATE_MAX;
+  rw->ring = rw->code + REWIND_CODE_MAX;
+  rw->capacity = capacity;
+  OPLL_Rewind_clear(rw);
+  return rw;
+}
+
+void OPLL_Rewind_delete(OPLL_Rewind *rw) {
+  opll_free(rw->mem);
+  opll_free(rw);
+}
+
+void OPLL_Rewind_clear(OPLL_Rewind *rw) {
+  rw->head = rw->used = rw->deltas = 0;
+  rw->state_size = 0;
+}
+
+uint32_t OPLL_Rewind_getFrames(OPLL_Rewind *rw) { return rw->deltas + (rw->state_size ? 1 : 0); }
+
+int OPLL_Rewind_push(OPLL_Rewind *rw, OPLL *opll) {
+  const uint32_t size = OPLL_getStateSize(opll);
+  uint8_t *t;
+
+  if (size > REWIND_STATE_MAX || !OPLL_saveState(opll, rw->work, size))
+    return 0;
+
+  if (rw->state_size == size) {
+    push_delta(rw, encode_delta(rw->state, rw->work, size, rw->code));
+  } else {
+    /* the rate converter has been changed: older states do not fit the chip any more. */
+    rw->head = rw->used = rw->deltas = 0;
+  }
+
+  t = rw->state;
+  rw->state = rw->work;
+  rw->work = t;
+  rw->state_size = size;
+  return 1;
+}
+
+int OPLL_Rewind_pop(OPLL_Rewind *rw, OPLL *opll) {
+  uint32_t len, end;
+
+  if (rw->state_size == 0 || !OPLL_loadState(opll, rw->state, rw->state_size))
+    return 0;
+
+  if (rw->deltas == 0) {
+    rw->state_size = 0;
+    return 1;
+  }
+  end = (rw->head + rw->capacity - 2) % rw->capacity;
+  len = ring_read16(rw, end);
+  ring_read(rw, (end + rw->capacity - len) % rw->capacity, rw->code, len);
+  apply_delta(rw->code, rw->state, rw->state_size);
+  rw->head = (rw->head + rw->capacity - len - 4) % rw->capacity;
+  rw->used -= len + 4;
+  rw->deltas--;
+  return 1;
+}
@@ -1,6 +1,7 @@
 #ifndef _EMU2413_H_
 #define _EMU2413_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -13,47 +14,47 @@ enum OPLL_TONE_ENUM { OPLL_2413_TONE = 0, OPLL_VRC7_TONE = 1, OPLL_281B_TONE = 2
 
 /* voice data */
 typedef struct __OPLL_PATCH {
-  uint32_t TL, FB, EG, ML, AR, DR, SL, RR, KR, KL, AM, PM, WS;
+  uint8_t TL, FB, EG, ML, AR, DR, SL, RR, KR, KL, AM, PM, WS;
 } OPLL_PATCH;
 
 /* slot */
+/* fields are ordered by size to avoid padding. */
+/*
+ * Configuration and envelope control of a slot. The state that changes on every sample (phase, envelope, total level
+ * and output) is kept in the per-slot arrays of OPLL, indexed by slot number.
+ */
 typedef struct __OPLL_SLOT {
-  uint8_t number;
-
-  /* type flags:
-   * 000000SM
-   *       |+-- M: 0:modulator 1:carrier
-   *       +--- S: 0:normal 1:single slot mode (sd, tom, hh or cym)
-   */
-  uint8_t type;
+  const OPLL_PATCH *patch; /* voice parameter */
 
-  OPLL_PATCH *patch; /* voice parameter */
-
-  /* slot output */
-  int32_t output[2]; /* output value, latest and previous. */
+  uint32_t idle_pm_phase; /* pm_phase when the slot became idle */
 
   /* phase generator (pg) */
-  uint16_t *wave_table; /* wave table */
-  uint32_t pg_phase;    /* pg phase */
-  uint32_t pg_out;      /* pg output, as index of wave table */
-  uint8_t pg_keep;      /* if 1, pg_phase is preserved when key-on */
-  uint16_t blk_fnum;    /* (block << 9) | f-number */
-  uint16_t fnum;        /* f-number (9 bits) */
-  uint8_t blk;          /* block (3 bits) */
+  uint16_t wave_mask; /* ORed to the second half of the wave, selects the wave form */
+  uint16_t blk_fnum;  /* (block << 9) | f-number */
+  uint16_t fnum;      /* f-number (9 bits) */
+  uint8_t blk;        /* block (3 bits) */
+  uint8_t pg_keep;    /* if 1, pg_phase is preserved when key-on */
 
   /* envelope generator (eg) */
   uint8_t eg_state;  /* current state */
-  int32_t volume;    /* current volume */
+  uint8_t volume;    /* current volume */
   uint8_t key_flag;  /* key-on flag 1:on 0:off */
   uint8_t sus_flag;  /* key-sus option 1:on 0:off */
-  uint16_t tll;      /* total level + key scale level*/
   uint8_t rks;       /* key scale offset (rks) for eg speed */
   uint8_t eg_rate_h; /* eg speed rate high 4bits */
   uint8_t eg_rate_l; /* eg speed rate low 2bits */
-  uint32_t eg_shift; /* shift for eg global counter, controls envelope speed */
-  uint32_t eg_out;   /* eg output */
+  uint8_t eg_shift;  /* shift for eg global counter, controls envelope speed */
+
+  uint8_t update_requests; /* flags to debounce update */
 
-  uint32_t update_requests; /* flags to debounce update */
+  uint8_t number;
+
+  /* type flags:
+   * 000000SM
+   *       |+-- M: 0:modulator 1:carrier
+   *       +--- S: 0:normal 1:single slot mode (sd, tom, hh or cym)
+   */
+  uint8_t type;
 
 #if OPLL_DEBUG
   uint8_t last_eg_state;
@@ -69,22 +70,98 @@ typedef struct __OPLL_SLOT {
 #define OPLL_MASK_BD (1 << (13))
 #define OPLL_MASK_RHYTHM (OPLL_MASK_HH | OPLL_MASK_CYM | OPLL_MASK_TOM | OPLL_MASK_SD | OPLL_MASK_BD)
 
+/* rate converter kernel */
+enum OPLL_RATECONV_KERNEL_ENUM {
+  OPLL_RATECONV_SINC = 0,   /* windowed sinc, band-limited */
+  OPLL_RATECONV_LINEAR = 1, /* linear interpolation, 2 taps */
+  OPLL_RATECONV_CUBIC = 2   /* Catmull-Rom cubic interpolation, 4 taps */
+};
+
+/* window function of OPLL_RATECONV_SINC */
+enum OPLL_RATECONV_WINDOW_ENUM { OPLL_RATECONV_BLACKMAN = 0, OPLL_RATECONV_HAMMING = 1 };
+
+/* rate converter quality */
+typedef struct __OPLL_RateConvConfig {
+  int kernel;   /* OPLL_RATECONV_SINC (default), OPLL_RATECONV_LINEAR or OPLL_RATECONV_CUBIC */
+  int taps;     /* number of taps of OPLL_RATECONV_SINC: even number from 2 to 64 (default 16) */
+  int window;   /* window of OPLL_RATECONV_SINC (default OPLL_RATECONV_BLACKMAN) */
+  int amp_bits; /* precision of filter coefficients in bits: 6 to 14 (default 12) */
+  int lookahead; /* taps of OPLL_RATECONV_SINC newer than the interpolation point: 1 to taps/2, or 0 for taps/2 */
+} OPLL_RateConvConfig;
+
+struct __OPLL_RateConvCoef;
+
 /* rate conveter */
 typedef struct __OPLL_RateConv {
   int ch;
-  double timer;
-  double f_ratio;
-  int16_t *sinc_table;
-  int16_t **buf;
+  int kernel;          /* OPLL_RATECONV_KERNEL_ENUM */
+  int window;          /* window of OPLL_RATECONV_SINC, 0 for the other kernels */
+  int taps;            /* number of filter taps */
+  int stride;          /* taps rounded up for SIMD processing */
+  int amp_bits;        /* precision of filter coefficients */
+  int lookahead;       /* number of taps newer than the interpolation point */
+  int hist_len;        /* length of the history of each channel, or number of frames if width is not 0 */
+  int width;           /* size of an interleaved frame of the history, 0 if each channel has its own history */
+  uint32_t num;        /* input / output frequency ratio is num / den */
+  uint32_t den;
+  uint32_t phase;      /* fractional position of the output as phase of the filter bank */
+  uint32_t rem;        /* remainder of the position below the phase resolution, in units of 1/den */
+  uint32_t step_phase; /* advance of phase per output sample */
+  uint32_t step_rem;   /* advance of rem per output sample */
+  const int16_t *coef; /* polyphase filter bank */
+  struct __OPLL_RateConvCoef *coef_entry; /* shared owner of coef */
+  int16_t *buf;   /* history of all channels, hist_len samples per channel */
+  uint32_t *head; /* position of the latest sample in the history of each channel */
+  void *mem;      /* memory block holding buf and head */
 } OPLL_RateConv;
 
 OPLL_RateConv *OPLL_RateConv_new(double f_inp, double f_out, int ch);
+OPLL_RateConv *OPLL_RateConv_newWithConfig(double f_inp, double f_out, int ch, const OPLL_RateConvConfig *config);
+void OPLL_RateConv_getDefaultConfig(OPLL_RateConvConfig *config);
 void OPLL_RateConv_reset(OPLL_RateConv *conv);
 void OPLL_RateConv_putData(OPLL_RateConv *conv, int ch, int16_t data);
 int16_t OPLL_RateConv_getData(OPLL_RateConv *conv, int ch);
+void OPLL_RateConv_putFrame(OPLL_RateConv *conv, const int16_t *data);
+void OPLL_RateConv_getFrame(OPLL_RateConv *conv, int16_t *out);
+double OPLL_RateConv_getDelay(OPLL_RateConv *conv);
 void OPLL_RateConv_delete(OPLL_RateConv *conv);
 
+/* capacity of the timestamped register write queue */
+#define OPLL_WRITE_QUEUE_SIZE 1024
+
+struct __OPLL_WRITE;
+
+/* number of output buses of the mixer. 0:left 1:right 2..:auxiliary */
+#define OPLL_BUS_MAX 4
+
+/* maximum number of additional outputs */
+#define OPLL_OUTPUT_MAX 4
+
+/* format of an additional output: the value is the number of channels of a frame */
+/* OPLL_OUTPUT_STEMS delivers each channel separately in the order of ch_out, before panning. */
+/* OPLL_OUTPUT_BUSES delivers all buses of the mixer, see OPLL_setBusGain. */
+enum OPLL_OUTPUT_MODE_ENUM {
+  OPLL_OUTPUT_MONO = 1,
+  OPLL_OUTPUT_STEREO = 2,
+  OPLL_OUTPUT_BUSES = OPLL_BUS_MAX,
+  OPLL_OUTPUT_STEMS = 14
+};
+
+struct __OPLL_OUTPUT;
+
+/* alignment of the memory of a chip that keeps each per-slot array of OPLL within as few cache lines as possible */
+#define OPLL_ALIGN 64
+
 typedef struct __OPLL {
+  /* per-sample state of the slots, indexed by slot number. kept first, so that it starts on a cache line. */
+  uint32_t pg_phase[18];   /* pg phase */
+  uint32_t pg_inc[18];     /* pg phase increment, with the PM of the current LFO step */
+  uint16_t pg_out[18];     /* pg output, as index of wave table */
+  int16_t slot_out[18][2]; /* output value of each slot, latest and previous. */
+  uint16_t tll[18];        /* total level + key scale level */
+  uint8_t eg_out[18];      /* eg output */
+  uint16_t eg_wake[18];    /* eg_counter at which a sleeping envelope is calculated again */
+
   uint32_t clk;
   uint32_t rate;
 
@@ -92,9 +169,10 @@ typedef struct __OPLL {
 
   uint32_t adr;
 
-  double inp_step;
-  double out_step;
-  double out_time;
+  /* output timing, scaled by 72 */
+  uint32_t inp_step;
+  uint32_t out_step;
+  uint32_t out_time;
 
   uint8_t reg[0x40];
   uint8_t test_flag;
@@ -105,43 +183,128 @@ typedef struct __OPLL {
 
   uint32_t pm_phase;
   int32_t am_phase;
+  uint8_t pg_inc_step; /* PM step that pg_inc is calculated at, or 8 if pg_inc is to be recalculated */
 
   uint8_t lfo_am;
 
   uint32_t noise;
+  uint32_t noise_lag; /* samples whose noise cycles are not applied yet, see catch_up_noise */
   uint8_t short_noise;
 
   int32_t patch_number[9];
   OPLL_SLOT slot[18];
-  OPLL_PATCH patch[19 * 2];
+  OPLL_PATCH user_patch[2];    /* modulator and carrier of patch 0. ROM patches: OPLL_getPatch */
+  const OPLL_PATCH *rom_patch; /* 19 * 2 patches of the ROM set, shared read-only data or rom_copy */
+  OPLL_PATCH *rom_copy;        /* memory of the private ROM set, allocated on the first change of a ROM patch */
 
   uint8_t pan[16];
   float pan_fine[16][2];
 
   uint32_t mask;
 
+  /* slots whose state does not change and whose output is not heard are idle and skipped by update_output. */
+  uint32_t idle_mask;
+  uint32_t recon_mask;    /* idle modulators whose output history is rebuilt when they wake up */
+  uint32_t stale_mask;    /* slots whose output history is not exact while OPLL_advance skips their output */
+  uint32_t defer_mask;    /* slots whose phase is caught up later while OPLL_advance skips their output */
+  uint32_t hold_mask;     /* deferred slots whose envelope does not change either */
+  uint32_t eg_sleep_mask; /* slots whose envelope is not calculated until eg_counter reaches eg_wake */
+
   /* channel output */
-  /* 0..8:tone 9:bd 10:hh 11:sd 12:tom 13:cym */
-  int16_t ch_out[14];
+  /* 0..8:tone 9:bd 10:hh 11:sd 12:tom 13:cym 14,15:always 0 */
+  int16_t ch_out[16];
 
-  int16_t mix_out[2];
+  /* gain of each channel on each bus of the mixer, derived from pan, pan_fine and OPLL_setBusGain */
+  int16_t mix_gain[OPLL_BUS_MAX][16];
+  uint16_t float_pan_mask; /* channels whose pan_fine gains need the float mix to keep the output exact */
 
-  OPLL_RateConv *conv;
+  int16_t mix_out[2];
+  uint8_t stereo_out; /* the last output sample was calculated in stereo */
+
+  OPLL_RateConv *conv;       /* NULL if the rate is clock / 72 */
+  OPLL_RateConv *conv_store; /* memory of conv, kept while the rate changes */
+  struct __OPLL_RateConvCoef *coef_spare; /* filter bank of the previous or prepared rate */
+  OPLL_RateConvConfig conv_config;
+
+  /* timestamped register writes */
+  uint32_t inp_count; /* number of internal samples synthesized since reset */
+  uint32_t out_count; /* number of output samples calculated since reset */
+  struct __OPLL_WRITE *write_queue;
+  uint32_t wq_head;
+  uint32_t wq_tail;
+
+  /* additional outputs */
+  struct __OPLL_OUTPUT *output[OPLL_OUTPUT_MAX];
+  uint32_t num_outputs;
 } OPLL;
 
+/**
+ * Set the functions used for every memory allocation of the library, e.g. to allocate from a pool or an arena.
+ * Call this before any chip or converter is created; memory is always released with the functions that are set at
+ * that time. NULL restores malloc and free.
+ * @param user passed to both functions as is.
+ */
+void OPLL_setAllocator(void *(*alloc)(size_t size, void *user), void (*release)(void *ptr, void *user), void *user);
+
 OPLL *OPLL_new(uint32_t clk, uint32_t rate);
 void OPLL_delete(OPLL *);
 
+/**
+ * Get the size of the memory to construct a chip with OPLL_init.
+ */
+size_t OPLL_sizeof(void);
+
+/**
+ * Construct a chip in caller-provided memory of OPLL_sizeof() bytes, aligned at least as memory returned by malloc.
+ * Memory aligned to OPLL_ALIGN bytes, as OPLL_new allocates, keeps the per-slot state on the fewest cache lines.
+ * The rate converter and other internal buffers are still allocated through OPLL_setAllocator.
+ * @return the chip at `mem`, or NULL if the internal buffers could not be allocated.
+ */
+OPLL *OPLL_init(void *mem, uint32_t clk, uint32_t rate);
+
+/**
+ * Destruct a chip constructed by OPLL_init. The memory of the chip itself is left to the caller.
+ */
+void OPLL_deinit(OPLL *opll);
+
 void OPLL_reset(OPLL *);
 void OPLL_resetPatch(OPLL *, uint8_t);
 
 /**
  * Set output wave sampling rate.
+ * The memory of the rate converter is reused. The filter bank of the previous rate is kept as a spare, so switching
+ * to the previous rate or to the one given to OPLL_prepareRate neither allocates memory nor calls libm, and is safe on
+ * a realtime thread. Any other rate may build a new filter bank.
+ * OPLL_reset does not allocate either.
  * @param rate sampling rate. If clock / 72 (typically 49716 or 49715 at 3.58MHz) is set, the internal rate converter is
  * disabled.
  */
 void OPLL_setRate(OPLL *opll, uint32_t rate);
 
+/**
+ * Build the filter bank for a rate ahead of time, so that a later OPLL_setRate(opll, rate) is realtime-safe.
+ * Call this outside of the realtime thread, e.g. when the output device is about to be reopened. It replaces the
+ * spare filter bank unless the current or the spare bank already fits the rate.
+ * @return 0 if the memory could not be allocated.
+ */
+int OPLL_prepareRate(OPLL *opll, uint32_t rate);
+
+/**
+ * Set quality of the internal rate converter.
+ * Lower tap counts or the interpolation kernels are cheaper; the default is a 16-tap windowed sinc.
+ * @param config converter settings, or NULL to restore the default.
+ */
+void OPLL_setRateConvConfig(OPLL *opll, const OPLL_RateConvConfig *config);
+
+/**
+ * Get the delay of the output signal caused by the rate conversion.
+ * Host side buffering is not included. Use this value to align the audio with the video of an emulator.
+ * The default filter delays 8 samples of the internal rate; set `lookahead` of OPLL_RateConvConfig to 1 or 2 for the
+ * lowest latency at the cost of a slightly worse stopband.
+ * @return delay in output samples from a register write to its effect, relative to the output without conversion.
+ */
+double OPLL_getLatency(OPLL *opll);
+
 /**
  * Set internal calcuration quality. Currently no effects, just for compatibility.
  * >= v1.0.0 always synthesizes internal output at clock/72 Hz.
@@ -165,9 +328,21 @@ void OPLL_setPan(OPLL *opll, uint32_t ch, uint8_t pan);
  * @param ch 0..8:tone 9:bd 10:hh 11:sd 12:tom 13:cym 14,15:reserved
  * @param pan output strength of left/right channel.
  *            pan[0]: left, pan[1]: right. pan[0]=pan[1]=1.0f for center.
+ * Gains of -2, -1, 0 and 1 are mixed in integer arithmetic, any other gain selects the slower float mix so that the
+ * output does not change. Buses 0 and 1 of OPLL_OUTPUT_BUSES are the same as the stereo output.
  */
 void OPLL_setPanFine(OPLL *opll, uint32_t ch, float pan[2]);
 
+/**
+ * Set the gain of a channel on an auxiliary bus of the mixer. Buses 0 and 1 follow OPLL_setPan/OPLL_setPanFine.
+ * All buses are delivered by an additional output in OPLL_OUTPUT_BUSES mode. OPLL_reset clears the gains to 0.
+ * @param bus 2..OPLL_BUS_MAX-1
+ * @param ch 0..13, same as OPLL_setPan
+ * @param gain -2.0 (inclusive) to 2.0 (exclusive), rounded to 1/16384 steps
+ * @return 1 if the gain is set, 0 if an argument is out of range and nothing is changed
+ */
+int OPLL_setBusGain(OPLL *opll, uint32_t bus, uint32_t ch, float gain);
+
 /**
  * Set chip type. If vrc7 is selected, r#14 is ignored.
  * This method not change the current ROM patch set.
@@ -179,6 +354,63 @@ void OPLL_setChipType(OPLL *opll, uint8_t type);
 void OPLL_writeIO(OPLL *opll, uint32_t reg, uint8_t val);
 void OPLL_writeReg(OPLL *opll, uint32_t reg, uint8_t val);
 
+/**
+ * Queue a register write that is applied just before the internal sample `time` is synthesized.
+ * Queued writes are applied while OPLL_calc* functions run, so a whole block can be rendered in one call
+ * without losing the timing of each write.
+ * Writes must be queued in chronological order. A write whose time has already passed is applied at the next
+ * internal sample.
+ * @param time internal sample count (clock / 72 Hz unit), see OPLL_getTime.
+ * The queue is allocated with the chip, so queueing a write never allocates memory.
+ * @return 1 if queued, 0 if the queue is full or `reg` is not a register of the chip (0x40 or above).
+ */
+int OPLL_writeRegAt(OPLL *opll, uint32_t time, uint32_t reg, uint8_t val);
+
+/**
+ * Same as OPLL_writeRegAt, but the write is stamped with an output sample count (see OPLL_getSampleCount).
+ * The write is applied before the first internal sample synthesized for the output sample `sample`.
+ */
+int OPLL_writeRegAtSample(OPLL *opll, uint32_t sample, uint32_t reg, uint8_t val);
+
+/**
+ * Discard all queued writes.
+ */
+void OPLL_clearWriteQueue(OPLL *opll);
+
+/**
+ * Get the number of internal samples (clock / 72 Hz unit) synthesized since the last reset.
+ */
+uint32_t OPLL_getTime(OPLL *opll);
+
+/**
+ * Get the number of output samples calculated since the last reset.
+ */
+uint32_t OPLL_getSampleCount(OPLL *opll);
+
+/**
+ * Add an output that delivers the same sound at another sampling rate, without synthesizing it twice.
+ * The output is fed while the chip is rendered by OPLL_calc* and its frames are buffered until OPLL_readOutput.
+ * It uses the rate converter settings of the chip, and is reset by OPLL_reset, OPLL_setRateConvConfig and
+ * OPLL_loadState.
+ * @param mode OPLL_OUTPUT_MONO, OPLL_OUTPUT_STEREO or OPLL_OUTPUT_STEMS. Stereo outputs follow OPLL_setPan and
+ * OPLL_setPanFine.
+ * @param capacity size of the buffer in frames. Frames produced while the buffer is full are dropped.
+ * @return index of the output, or -1 on failure.
+ */
+int OPLL_addOutput(OPLL *opll, uint32_t rate, int mode, uint32_t capacity);
+
+/** Remove the output added by OPLL_addOutput. */
+void OPLL_removeOutput(OPLL *opll, int index);
+
+/** Number of frames buffered in the output. */
+uint32_t OPLL_getOutputFrames(OPLL *opll, int index);
+
+/**
+ * Read buffered frames of the output. The channels of each frame are interleaved.
+ * @return number of frames read.
+ */
+uint32_t OPLL_readOutput(OPLL *opll, int index, int16_t *out, uint32_t frames);
+
 /**
  * Calculate one sample
  */
@@ -189,8 +421,133 @@ int16_t OPLL_calc(OPLL *opll);
  */
 void OPLL_calcStereo(OPLL *opll, int32_t out[2]);
 
-void OPLL_setPatch(OPLL *, const uint8_t *dump);
-void OPLL_copyPatch(OPLL *, int32_t, OPLL_PATCH *);
+/**
+ * Calculate a block of mono samples.
+ * The result is identical to calling OPLL_calc `frames` times.
+ * @param out buffer to store `frames` samples.
+ */
+void OPLL_calcBlock(OPLL *opll, int16_t *out, uint32_t frames);
+
+/**
+ * Calculate a block of stereo samples.
+ * The result is identical to calling OPLL_calcStereo `frames` times.
+ * @param out buffer to store `frames * 2` samples, interleaved as L,R,L,R...
+ */
+void OPLL_calcStereoBlock(OPLL *opll, int32_t *out, uint32_t frames);
+
+/**
+ * Same as OPLL_calcStereoBlock, but stores 16-bit samples.
+ */
+void OPLL_calcStereoBlock16(OPLL *opll, int16_t *out, uint32_t frames);
+
+/**
+ * Same as OPLL_calcStereoBlock, but stores left and right samples to separate buffers.
+ */
+void OPLL_calcStereoBlockPlanar(OPLL *opll, int32_t *left, int32_t *right, uint32_t frames);
+
+/**
+ * Advance the chip by `frames` output samples without synthesizing them, e.g. to seek in a song.
+ * Afterwards the chip is in the same state as after calculating the samples in mono or stereo, whichever was used
+ * last, so the following samples are bit-identical. Queued writes in the range are applied on time.
+ * Additional outputs skip the range as well: their buffered frames are discarded.
+ */
+void OPLL_advance(OPLL *opll, uint32_t frames);
+
+/**
+ * Get the size in bytes of the state saved by OPLL_saveState. It depends on the taps of the rate converter.
+ */
+uint32_t OPLL_getStateSize(OPLL *opll);
+
+/**
+ * Save the state of the chip: registers, patches, envelope and phase of every slot, LFO, noise, sample counters and
+ * the history of the rate converter. Host settings such as pan, mask and additional outputs are not included, and
+ * neither are queued writes. The format is versioned and does not depend on the byte order of the host.
+ * @param buf buffer of at least OPLL_getStateSize bytes.
+ * @return number of bytes written, or 0 if the buffer is too small.
+ */
+uint32_t OPLL_saveState(OPLL *opll, void *buf, uint32_t size);
+
+/**
+ * Restore a state saved by OPLL_saveState, without allocating memory. A state whose ROM patches differ from the
+ * built-in sets needs the private ROM set of the chip, see OPLL_preparePatch; if it was never allocated, it is
+ * allocated here.
+ * The chip must have the same clock, rate and number of converter taps as the saved one. Samples calculated
+ * afterwards are identical to those of the saved chip. Queued writes are discarded. Additional outputs are not part
+ * of the state: they are reset, so their buffered frames are dropped and their converters restart from silence.
+ * @return 1 on success, or 0 if the state is broken or does not fit the chip. The chip is unchanged then.
+ */
+int OPLL_loadState(OPLL *opll, const void *buf, uint32_t size);
+
+/**
+ * Get a 64-bit hash of the deterministic state of the chip: registers, envelope and phase of every slot, LFO, noise
+ * and the envelope counter, e.g. to detect desyncs in netplay. Host settings such as mask and pan, the sample counters
+ * and the output history are not included. The hash takes a few hundred nanoseconds and does not change the chip.
+ */
+uint64_t OPLL_stateHash(OPLL *opll);
+
+/* rewind buffer */
+typedef struct __OPLL_Rewind OPLL_Rewind;
+
+/**
+ * Create a buffer that keeps the recent states of a chip for rewinding, e.g. one state per video frame.
+ * The newest state is kept in full and each older state as the difference to the state after it. The oldest states are
+ * dropped when the history exceeds `capacity`.
+ * The phases, slot outputs and converter history change on every sample and cannot be coded away, so at 60 states per
+ * second a second of history costs about 3 KB for a silent chip, 12 KB with three voices and 20 KB with nine. Push
+ * less often than once per frame if the history has to be smaller.
+ * @param capacity size of the history in bytes, in addition to about 4KB for the newest state and work buffers.
+ */
+OPLL_Rewind *OPLL_Rewind_new(uint32_t capacity);
+void OPLL_Rewind_delete(OPLL_Rewind *rw);
+
+/** Drop all states. */
+void OPLL_Rewind_clear(OPLL_Rewind *rw);
+
+/** Number of states in the buffer. */
+uint32_t OPLL_Rewind_getFrames(OPLL_Rewind *rw);
+
+/**
+ * Capture the state of the chip as the newest state, see OPLL_saveState.
+ * If the rate converter settings of the chip have changed, the older states are dropped.
+ * @return 1 on success, 0 on failure.
+ */
+int OPLL_Rewind_push(OPLL_Rewind *rw, OPLL *opll);
+
+/**
+ * Restore the newest state to the chip with OPLL_loadState and remove it from the buffer, so that repeated calls step
+ * back one state at a time. No register writes are replayed.
+ * @return 1 on success, or 0 if the buffer is empty or the state does not fit the chip.
+ */
+int OPLL_Rewind_pop(OPLL_Rewind *rw, OPLL *opll);
+
+/**
+ * Set all patches from a dump of 19 * 8 bytes, the user patch first.
+ * The ROM patches of a chip are shared read-only data as long as they equal one of the built-in sets; otherwise the
+ * chip uses a private copy of them. Its memory is allocated on the first such change and kept until the chip is
+ * deleted.
+ * @return 1 on success, or 0 if the private copy could not be allocated and the chip is unchanged.
+ */
+int OPLL_setPatch(OPLL *, const uint8_t *dump);
+
+/**
+ * Allocate the private ROM set ahead of time, so that later patch changes and OPLL_loadState never allocate memory,
+ * e.g. before the chip is used on a realtime thread or rewound.
+ * @return 0 if the memory could not be allocated.
+ */
+int OPLL_preparePatch(OPLL *opll);
+
+/**
+ * Set patch `num`: 0 and 1 are the modulator and the carrier of the user patch, 2 * n and 2 * n + 1 those of ROM patch
+ * n. Changing a ROM patch gives the chip a private copy of the ROM set. OPLL_resetPatch returns to the shared set.
+ * @return 1 on success, or 0 if the private copy could not be allocated and the patch is unchanged.
+ */
+int OPLL_copyPatch(OPLL *, int32_t, OPLL_PATCH *);
+
+/**
+ * Get patch `num` of the chip, numbered as in OPLL_copyPatch.
+ * OPLL.user_patch holds only the user patch; use this to read the ROM patches.
+ */
+void OPLL_getPatch(OPLL *, int32_t num, OPLL_PATCH *patch);
 
 /**
  * Force to refresh.
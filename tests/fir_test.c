@@ -0,0 +1,70 @@
+/* the SIMD kernel of wide rate converters gives the same samples as the portable one */
+#include "emu2413.c"
+#include "test_util.h"
+
+#define OUTPUTS 2000
+
+/* only converters of more than RATECONV_PLANAR_MAX channels interleave their history and use the kernel */
+static const int test_channels[] = {3, 4, 5, 8, 9, 14, 16, 17};
+static const int test_taps[] = {2, 4, 6, 10, 16, 24, 32, 48, 64};
+
+static int16_t test_sample(void) {
+  switch (test_rand() % 8) {
+  case 0:
+    return 32767;
+  case 1:
+    return -32768;
+  default:
+    return (int16_t)test_rand();
+  }
+}
+
+static void test_kernels(int ch, const OPLL_RateConvConfig *config, double f_out) {
+  OPLL_RateConv *conv = OPLL_RateConv_newWithConfig(3579545 / 72.0, f_out, ch, config);
+  int16_t frame[32], out[32], ref[32];
+  int i, c;
+
+  OPLL_RateConv_reset(conv);
+  for (i = 0; i < OUTPUTS; i++) {
+    for (c = 0; c < ch; c++) {
+      frame[c] = test_sample();
+    }
+    OPLL_RateConv_putFrame(conv, frame);
+    advance_rate_conv(conv);
+
+    fir_dot_frames(conv, RATECONV_FRAMES(conv), conv->coef + conv->phase * conv->stride, out);
+    fir_dot_frames_c(conv, RATECONV_FRAMES(conv), conv->coef + conv->phase * conv->stride, ref);
+    CHECK(memcmp(out, ref, sizeof(int16_t) * ch) == 0, "ch %d taps %d: fir_dot_frames differs", ch, conv->taps);
+  }
+
+  OPLL_RateConv_delete(conv);
+}
+
+int main(void) {
+  OPLL_RateConvConfig config;
+  uint32_t c, t;
+
+#if EMU2413_AVX2 && defined(__GNUC__)
+  if (!__builtin_cpu_supports("avx2")) {
+    printf("fir: skipped, the CPU has no AVX2\n");
+    return 0;
+  }
+#endif
+
+  test_seed = 3000;
+  for (c = 0; c < sizeof(test_channels) / sizeof(test_channels[0]); c++) {
+    for (t = 0; t < sizeof(test_taps) / sizeof(test_taps[0]); t++) {
+      OPLL_RateConv_getDefaultConfig(&config);
+      config.taps = test_taps[t];
+      config.amp_bits = t % 2 ? 14 : 12;
+      test_kernels(test_channels[c], &config, test_rates[t % TEST_RATES]);
+    }
+    OPLL_RateConv_getDefaultConfig(&config);
+    config.kernel = OPLL_RATECONV_LINEAR;
+    test_kernels(test_channels[c], &config, 44100);
+    config.kernel = OPLL_RATECONV_CUBIC;
+    test_kernels(test_channels[c], &config, 48000);
+  }
+
+  return test_result("fir");
+}
@@ -0,0 +1,78 @@
+/* the stereo mix is the same as the float mix of older versions, whatever the pan gains are */
+#include "test_util.h"
+
+#define BLOCKS 100
+
+/* at this rate every frame is one sample of the chip and the output is the mix itself */
+#define MIX_RATE 49716
+
+static const float test_gains[] = {0.0f, 1.0f, -1.0f, -2.0f, 0.5f, 0.7071f, 1.25f, 2.0f, 3.0f, -0.3f};
+#define TEST_GAINS (sizeof(test_gains) / sizeof(test_gains[0]))
+
+static void float_mix(OPLL *opll, const float gain[14][2], const uint8_t pan[14], int16_t out[2]) {
+  int i;
+  out[0] = out[1] = 0;
+  for (i = 0; i < 14; i++) {
+    if (pan[i] & 2)
+      out[0] += (int16_t)(opll->ch_out[i] * gain[i][0]);
+    if (pan[i] & 1)
+      out[1] += (int16_t)(opll->ch_out[i] * gain[i][1]);
+  }
+}
+
+static void test_pan(void) {
+  OPLL *opll = OPLL_new(MIX_RATE * 72, MIX_RATE);
+  float gain[14][2];
+  uint8_t pan[14];
+  int blk, i, n;
+
+  for (i = 0; i < 14; i++) {
+    gain[i][0] = gain[i][1] = 1.0f;
+    pan[i] = 3;
+  }
+  for (blk = 0; blk < BLOCKS; blk++) {
+    /* mostly integer gains, which are mixed in integer arithmetic, and sometimes one that is not */
+    for (i = 0; i < 14; i++) {
+      const uint32_t r = test_rand() % 16;
+      gain[i][0] = test_gains[r < TEST_GAINS ? r : r % 4];
+      gain[i][1] = test_gains[test_rand() % 4];
+      pan[i] = (uint8_t)(test_rand() & 3);
+      OPLL_setPanFine(opll, i, gain[i]);
+      OPLL_setPan(opll, i, pan[i]);
+    }
+    for (n = test_rand() % 4; n > 0; n--) {
+      test_random_write(opll);
+    }
+    for (n = 0; n < 500; n++) {
+      int32_t out[2];
+      int16_t ref[2];
+      OPLL_calcStereo(opll, out);
+      float_mix(opll, (const float(*)[2])gain, pan, ref);
+      CHECK(out[0] == ref[0] && out[1] == ref[1], "blk %d: stereo mix %d,%d differs from float mix %d,%d", blk,
+            (int)out[0], (int)out[1], ref[0], ref[1]);
+    }
+  }
+
+  OPLL_delete(opll);
+}
+
+/* gains the integer buses cannot hold are refused */
+static void test_bus_gain(void) {
+  OPLL *opll = OPLL_new(3579545, 44100);
+
+  CHECK(OPLL_setBusGain(opll, 2, 0, 0.5f), "gain 0.5 is refused");
+  CHECK(OPLL_setBusGain(opll, 3, 13, -2.0f), "gain -2.0 is refused");
+  CHECK(!OPLL_setBusGain(opll, 2, 0, 2.0f), "gain 2.0 is accepted");
+  CHECK(!OPLL_setBusGain(opll, 2, 0, -2.5f), "gain -2.5 is accepted");
+  CHECK(!OPLL_setBusGain(opll, 1, 0, 1.0f), "bus 1 is accepted");
+  CHECK(!OPLL_setBusGain(opll, 2, 14, 1.0f), "channel 14 is accepted");
+
+  OPLL_delete(opll);
+}
+
+int main(void) {
+  test_seed = 12;
+  test_pan();
+  test_bus_gain();
+  return test_result("mix");
+}
@@ -0,0 +1,302 @@
+/* OPLL_saveState / OPLL_loadState round trips, OPLL_stateHash, broken states and the rewind buffer */
+#include "test_util.h"
+
+#define BLOCKS 200
+
+static uint8_t blob[4096], blob2[4096];
+static int32_t out_a[1 << 14], out_b[1 << 14];
+
+static void set_config(OPLL *opll, int cfg) {
+  OPLL_RateConvConfig c;
+  if (cfg == 2) {
+    OPLL_RateConv_getDefaultConfig(&c);
+    c.taps = 32;
+    c.lookahead = 2;
+    OPLL_setRateConvConfig(opll, &c);
+  }
+}
+
+/* a state loaded into another chip renders the same samples and has the same hash */
+static void test_round_trip(uint32_t rate, int cfg) {
+  OPLL *a = OPLL_new(3579545, rate), *b = OPLL_new(3579545, rate);
+  int blk, stereo = cfg & 1;
+
+  set_config(a, cfg);
+  set_config(b, cfg);
+  OPLL_resetPatch(a, cfg);
+  OPLL_setChipType(a, cfg == 1);
+
+  for (blk = 0; blk < BLOCKS; blk++) {
+    const uint32_t n = test_rand() % 3000 + 1;
+    uint32_t size, k, w;
+
+    for (w = test_rand() % 4; w > 0; w--) {
+      test_random_write(a);
+    }
+    test_render(a, stereo, out_a, n);
+    if (test_rand() % 4)
+      continue;
+
+    size = OPLL_saveState(a, blob, sizeof(blob));
+    CHECK(size == OPLL_getStateSize(a), "rate %u cfg %d: state size %u", rate, cfg, size);
+    CHECK(OPLL_loadState(b, blob, size), "rate %u cfg %d: load failed", rate, cfg);
+    CHECK(OPLL_saveState(b, blob2, sizeof(blob2)) == size && memcmp(blob, blob2, size) == 0,
+          "rate %u cfg %d blk %d: saved state differs after load", rate, cfg, blk);
+    CHECK(OPLL_stateHash(a) == OPLL_stateHash(b), "rate %u cfg %d blk %d: hash differs after load", rate, cfg, blk);
+
+    for (k = 0; k < 3; k++) {
+      const uint32_t m = test_rand() % 2000 + 1;
+      for (w = test_rand() % 3; w > 0; w--) {
+        const uint32_t s = test_seed;
+        test_random_write(a);
+        test_seed = s;
+        test_random_write(b);
+      }
+      test_render(a, stereo, out_a, m);
+      test_render(b, stereo, out_b, m);
+      CHECK(memcmp(out_a, out_b, sizeof(int32_t) * m * (stereo ? 2 : 1)) == 0,
+            "rate %u cfg %d blk %d: output differs after load", rate, cfg, blk);
+      CHECK(OPLL_stateHash(a) == OPLL_stateHash(b), "rate %u cfg %d blk %d: hash differs", rate, cfg, blk);
+    }
+  }
+
+  /* a register write that changes the chip changes the hash */
+  {
+    const uint64_t h = OPLL_stateHash(a);
+    OPLL_writeReg(a, 0x10, (uint8_t)(a->reg[0x10] ^ 1));
+    CHECK(OPLL_stateHash(a) != h, "rate %u cfg %d: hash does not change", rate, cfg);
+  }
+
+  OPLL_delete(a);
+  OPLL_delete(b);
+}
+
+/* offsets in a saved state, see the State Snapshot section of emu2413.c */
+#define STATE_RHYTHM_MODE (14 + 0x40 + 2)
+#define STATE_SLOT(i) (14 + 0x40 + 7 + 4 * 8 + 9 + 19 * 8 + 2 * 16 + 28 * (i))
+#define SLOT_TYPE 0
+#define SLOT_EG_STATE 4
+#define SLOT_VOLUME 7
+#define SLOT_RKS 8
+#define SLOT_TLL 16
+
+static void expect_rejected(OPLL *opll, uint32_t size, const char *what) {
+  uint32_t size2;
+  CHECK(!OPLL_loadState(opll, blob2, size), "%s: broken state is accepted", what);
+  size2 = OPLL_saveState(opll, blob2, sizeof(blob2));
+  CHECK(size2 == size && memcmp(blob, blob2, size) == 0, "%s: chip is changed by a rejected state", what);
+}
+
+/* states with fields out of the range of the chip are rejected, and the chip is left unchanged */
+static void test_broken_states(void) {
+  OPLL *opll = OPLL_new(3579545, 44100);
+  uint32_t size;
+  int i;
+
+  for (i = 0; i < 9; i++) {
+    OPLL_writeReg(opll, 0x30 + i, 0x30);
+    OPLL_writeReg(opll, 0x10 + i, 0x80);
+    OPLL_writeReg(opll, 0x20 + i, 0x14);
+  }
+  OPLL_writeReg(opll, 0x0e, 0x20);
+  test_render(opll, 1, out_a, 1000);
+  size = OPLL_saveState(opll, blob, sizeof(blob));
+
+  memcpy(blob2, blob, size);
+  CHECK(OPLL_loadState(opll, blob2, size), "valid state is rejected");
+
+  /* a modulator claiming to be a carrier in DAMP would reset the phase of slot -1 */
+  memcpy(blob2, blob, size);
+  blob2[STATE_SLOT(0) + SLOT_TYPE] = 1;
+  blob2[STATE_SLOT(0) + SLOT_EG_STATE] = 4;
+  expect_rejected(opll, size, "carrier type on slot 0");
+
+  memcpy(blob2, blob, size);
+  blob2[STATE_SLOT(14) + SLOT_TYPE] = 0;
+  expect_rejected(opll, size, "normal type on a rhythm slot");
+
+  memcpy(blob2, blob, size);
+  blob2[STATE_SLOT(3) + SLOT_TYPE] = 3;
+  expect_rejected(opll, size, "rhythm type on a melody slot");
+
+  memcpy(blob2, blob, size);
+  blob2[STATE_RHYTHM_MODE] = 2;
+  expect_rejected(opll, size, "rhythm mode 2");
+
+  memcpy(blob2, blob, size);
+  blob2[STATE_SLOT(5) + SLOT_VOLUME] = 64;
+  expect_rejected(opll, size, "volume");
+
+  memcpy(blob2, blob, size);
+  blob2[STATE_SLOT(5) + SLOT_RKS] = 16;
+  expect_rejected(opll, size, "rks");
+
+  memcpy(blob2, blob, size);
+  blob2[STATE_SLOT(5) + SLOT_TLL + 1] = 1;
+  expect_rejected(opll, size, "tll");
+
+  OPLL_delete(opll);
+}
+
+static uint32_t allocations;
+static int fail_allocations;
+
+static void *count_alloc(size_t size, void *user) {
+  (void)user;
+  allocations++;
+  return fail_allocations ? NULL : malloc(size);
+}
+
+static void count_free(void *ptr, void *user) {
+  (void)user;
+  free(ptr);
+}
+
+/* states with ROM patches of their own are loaded into the prepared private ROM set without allocation */
+static void test_rom_patch_states(void) {
+  OPLL *a = OPLL_new(3579545, 44100), *b = OPLL_new(3579545, 44100);
+  OPLL_PATCH patch[2];
+  uint32_t custom, size, count;
+  int i;
+
+  for (i = 0; i < 9; i++) {
+    OPLL_writeReg(a, 0x30 + i, 0x10 * (i + 1));
+    OPLL_writeReg(a, 0x10 + i, 0x80);
+    OPLL_writeReg(a, 0x20 + i, 0x14);
+  }
+  size = OPLL_saveState(a, blob2, sizeof(blob2));
+  OPLL_getDefaultPatch(0, 3, patch);
+  patch[0].AR = 3;
+  OPLL_copyPatch(a, 6, &patch[0]);
+  {
+    OPLL_PATCH got;
+    OPLL_getPatch(a, 6, &got);
+    CHECK(memcmp(&got, &patch[0], sizeof(got)) == 0, "getPatch does not return the copied patch");
+    OPLL_getPatch(b, 6, &got);
+    OPLL_getDefaultPatch(0, 3, patch);
+    CHECK(memcmp(&got, &patch[0], sizeof(got)) == 0, "getPatch does not return the ROM patch");
+  }
+  test_render(a, 1, out_a, 1000);
+  custom = OPLL_saveState(a, blob, sizeof(blob));
+
+  CHECK(OPLL_preparePatch(b), "preparePatch failed");
+  count = allocations;
+  for (i = 0; i < 3; i++) {
+    CHECK(OPLL_loadState(b, blob2, size), "load of built-in ROM state failed");
+    CHECK(OPLL_loadState(b, blob, custom), "load of private ROM state failed");
+  }
+  CHECK(allocations == count, "loadState allocated %u times", allocations - count);
+
+  test_render(a, 1, out_a, 1000);
+  test_render(b, 1, out_b, 1000);
+  CHECK(memcmp(out_a, out_b, sizeof(int32_t) * 2000) == 0, "output differs after load of private ROM state");
+
+  OPLL_delete(a);
+  OPLL_delete(b);
+}
+
+/* patch changes that need the private ROM set fail without changing the chip if it cannot be allocated */
+static void test_patch_alloc_failure(void) {
+  OPLL *opll = OPLL_new(3579545, 44100);
+  OPLL_PATCH rom[19 * 2], got[2];
+  uint8_t dump[19 * 8];
+  int i;
+
+  for (i = 0; i < 19; i++) {
+    OPLL_getDefaultPatch(0, i, &rom[i * 2]);
+    OPLL_patchToDump(&rom[i * 2], dump + i * 8);
+  }
+  dump[0] ^= 1;
+  dump[3 * 8 + 4] ^= 0x10;
+
+  fail_allocations = 1;
+  CHECK(!OPLL_setPatch(opll, dump), "setPatch succeeds without memory");
+  CHECK(!OPLL_copyPatch(opll, 6, &rom[0]), "copyPatch succeeds without memory");
+  OPLL_getPatch(opll, 0, &got[0]);
+  OPLL_getPatch(opll, 6, &got[1]);
+  CHECK(memcmp(&got[0], &rom[0], sizeof(OPLL_PATCH)) == 0 && memcmp(&got[1], &rom[6], sizeof(OPLL_PATCH)) == 0,
+        "failed patch change modifies the chip");
+  fail_allocations = 0;
+
+  CHECK(OPLL_setPatch(opll, dump), "setPatch failed");
+  OPLL_getPatch(opll, 6, &got[1]);
+  CHECK(got[1].AR == (rom[6].AR ^ 1), "setPatch does not change the ROM patch");
+
+  OPLL_delete(opll);
+}
+
+/* additional outputs restart from silence after a load, whatever they converted before */
+static void test_output_restart(void) {
+  OPLL *a = OPLL_new(3579545, 44100), *b = OPLL_new(3579545, 44100);
+  static int16_t frames_a[2 * 4096], frames_b[2 * 4096];
+  uint32_t size, n_a, n_b;
+  int i;
+
+  CHECK(OPLL_addOutput(a, 48000, OPLL_OUTPUT_STEREO, 4096) == 0, "addOutput failed");
+  CHECK(OPLL_addOutput(b, 48000, OPLL_OUTPUT_STEREO, 4096) == 0, "addOutput failed");
+  for (i = 0; i < 9; i++) {
+    OPLL_writeReg(a, 0x30 + i, 0x10 * (i + 1));
+    OPLL_writeReg(a, 0x10 + i, 0x80);
+    OPLL_writeReg(a, 0x20 + i, 0x14);
+  }
+  test_render(a, 1, out_a, 1000);
+  size = OPLL_saveState(a, blob, sizeof(blob));
+  test_render(a, 1, out_a, 1000);
+
+  CHECK(OPLL_loadState(a, blob, size) && OPLL_loadState(b, blob, size), "load failed");
+  CHECK(OPLL_getOutputFrames(a, 0) == 0, "buffered frames are kept after load");
+  test_render(a, 1, out_a, 2000);
+  test_render(b, 1, out_b, 2000);
+  n_a = OPLL_readOutput(a, 0, frames_a, 4096);
+  n_b = OPLL_readOutput(b, 0, frames_b, 4096);
+  CHECK(n_a > 0 && n_a == n_b && memcmp(frames_a, frames_b, sizeof(int16_t) * 2 * n_a) == 0,
+        "additional output depends on what it converted before the load");
+
+  OPLL_delete(a);
+  OPLL_delete(b);
+}
+
+/* popping the rewind buffer restores the pushed states in reverse order */
+static void test_rewind(void) {
+  OPLL *opll = OPLL_new(3579545, 44100);
+  OPLL_Rewind *rw = OPLL_Rewind_new(1 << 16);
+  static uint8_t states[64][1024];
+  uint32_t size = OPLL_getStateSize(opll);
+  int i;
+
+  for (i = 0; i < 64; i++) {
+    test_random_write(opll);
+    test_render(opll, 1, out_a, 735);
+    OPLL_saveState(opll, states[i], sizeof(states[i]));
+    CHECK(OPLL_Rewind_push(rw, opll), "rewind push %d failed", i);
+  }
+  for (i = 63; i >= 0; i--) {
+    CHECK(OPLL_Rewind_pop(rw, opll), "rewind pop %d failed", i);
+    OPLL_saveState(opll, blob, sizeof(blob));
+    CHECK(memcmp(blob, states[i], size) == 0, "rewind pop %d: state differs", i);
+  }
+  CHECK(!OPLL_Rewind_pop(rw, opll), "rewind buffer is not empty");
+
+  OPLL_Rewind_delete(rw);
+  OPLL_delete(opll);
+}
+
+int main(void) {
+  uint32_t r;
+  int cfg;
+
+  OPLL_setAllocator(count_alloc, count_free, NULL);
+  for (r = 0; r < TEST_RATES; r++) {
+    for (cfg = 0; cfg < 3; cfg++) {
+      test_seed = r * 10 + cfg;
+      test_round_trip(test_rates[r], cfg);
+    }
+  }
+  test_broken_states();
+  test_rom_patch_states();
+  test_patch_alloc_failure();
+  test_output_restart();
+  test_rewind();
+
+  return test_result("state");
+}
@@ -0,0 +1,76 @@
+/* helpers shared by the regression tests */
+#ifndef _TEST_UTIL_H_
+#define _TEST_UTIL_H_
+
+#include "emu2413.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* not every test uses every helper */
+#if defined(__GNUC__)
+#define TEST_UNUSED __attribute__((unused))
+#else
+#define TEST_UNUSED
+#endif
+
+static const uint32_t test_rates[] = {44100, 48000, 49716, 96000, 22050, 8000};
+#define TEST_RATES (sizeof(test_rates) / sizeof(test_rates[0]))
+
+static uint32_t test_seed;
+static int test_failures;
+
+static uint32_t test_rand(void) {
+  test_seed = test_seed * 1103515245u + 12345u;
+  return (test_seed >> 8) & 0xffffff;
+}
+
+#define CHECK(cond, ...)                                                                                               \
+  do {                                                                                                                 \
+    if (!(cond)) {                                                                                                     \
+      if (test_failures++ < 10) {                                                                                      \
+        fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);                                                                \
+        fprintf(stderr, __VA_ARGS__);                                                                                  \
+        fprintf(stderr, "\n");                                                                                         \
+      }                                                                                                                \
+    }                                                                                                                  \
+  } while (0)
+
+/* a random register write, key-on, rhythm or test flag change that keeps the chip busy */
+TEST_UNUSED static void test_random_write(OPLL *opll) {
+  const uint32_t r = test_rand() % 100, ch = test_rand() % 9;
+
+  if (r < 30) {
+    OPLL_writeReg(opll, 0x20 + ch, (test_rand() & 0x2f) | (test_rand() % 3 ? 0 : 0x10));
+  } else if (r < 40) {
+    OPLL_writeReg(opll, 0x10 + ch, test_rand() & 0xff);
+  } else if (r < 55) {
+    OPLL_writeReg(opll, 0x30 + ch, (test_rand() % 3 ? 0 : 0x10 * (test_rand() % 16)) | (test_rand() & 15));
+  } else if (r < 65) {
+    OPLL_writeReg(opll, test_rand() % 8, test_rand() & 0xff);
+  } else if (r < 73) {
+    OPLL_writeReg(opll, 0x0e, (test_rand() & 1) ? 0x20 | (test_rand() & 0x1f) : 0);
+  } else if (r < 75) {
+    OPLL_writeReg(opll, 0x0f, test_rand() % 10 == 0 ? test_rand() & 0xf : 0);
+  } else {
+    OPLL_writeReg(opll, 0x20 + ch, test_rand() & 0x0f);
+  }
+}
+
+TEST_UNUSED static void test_render(OPLL *opll, int stereo, int32_t *buf, uint32_t frames) {
+  uint32_t i;
+  if (stereo) {
+    OPLL_calcStereoBlock(opll, buf, frames);
+  } else {
+    for (i = 0; i < frames; i++) {
+      buf[i] = OPLL_calc(opll);
+    }
+  }
+}
+
+static int test_result(const char *name) {
+  printf("%s: %s\n", name, test_failures ? "FAILED" : "ok");
+  return test_failures != 0;
+}
+
+#endif